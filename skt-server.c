@@ -2,6 +2,11 @@
 #include "util_tsl_server/tsl_server.h"
 #include "util_network_info/network_info.h"
 #include "util_gpg/gpg_session.h"
+#include "util_gpg/gpg_pool.h"
+#include "util_gpg/gpg_worker.h"
+#include "util_gpg/gpg_keycache.h"
+#include "util_gpg/gpg_watch.h"
+#include "util_event_loop/event_loop.h"
 
 #include <stdlib.h>
 
@@ -14,8 +19,22 @@
 
 #include <errno.h>
 
+#include <sys/timerfd.h>
+
 
 #define PORT 5556               /* listen to 5556 port */
+#define GPG_WORKERS 4           /* concurrent gpg export/import */
+#define READ_BUFFER 16384       /* one full TLS record */
+#define IMPORT_BATCH_MS 50      /* keys received within this window are imported by a single gpg run */
+#define SEND_QUEUE 65536        /* exported bytes queued for TLS before waiting for the socket */
+#define SOCKET_SEND_BUFFER 0    /* SO_SNDBUF of the client sockets, 0 lets the kernel tune it */
+#define SOCKET_RECEIVE_BUFFER 0 /* SO_RCVBUF, same */
+#define SOCKET_KTLS false       /* let the kernel encrypt the keys sent when it can (Linux 4.13, tls module), gnutls otherwise */
+#define KEYRING_SETTLE_MS 200   /* the keyring is listed again once gpg stopped writing it for this long */
+#define PAIRING_TOKENS 0        /* more QR codes, each pairs a single device, ie. to provision many at once */
+#define PAIRING_LIFETIME 600    /* seconds a pairing token stays valid */
+#define KEX_PROFILE KEX_DEFAULT /* KEX_X25519 is much cheaper on small CPUs, see the handshake times printed */
+#define RESUMPTION_LIFETIME 0   /* seconds a reconnecting device may resume its TLS session, 0 for a full handshake every time */
 
 int server_fd;
 
@@ -27,199 +46,779 @@ void open_server() {
 	
 	struct network_info info;
 	
+	server_set_kex_profile(KEX_PROFILE);
+	server_set_resumption(RESUMPTION_LIFETIME);
 	server_create(pskhex, sizeof(pskhex));
 	
+	struct socket_profile profile = SOCKET_PROFILE_DEFAULT;
+	profile.send_buffer = SOCKET_SEND_BUFFER;
+	profile.receive_buffer = SOCKET_RECEIVE_BUFFER;
+	profile.ktls = SOCKET_KTLS;
+	server_set_socket_profile(&profile);
+	
 	get_info(&info);
 	printf("%s - %s %ld %d %ld\n", info.ssid, info.ip, strlen(pskhex), PSK_BYTES, sizeof(pskhex));
 	
 	snprintf(urlbuf, sizeof(urlbuf)-1, "%s:%s/%d/%s%s%s", schema, info.ip, PORT, pskhex, "/SSID:", info.ssid);
 	create_and_print_qr(urlbuf, stdout);
 	
+	/* the identity goes in the URL, clients use "openpgp-skt" when there is none */
+	for (unsigned int i = 0; i < PAIRING_TOKENS; i++) {
+		char identity[PSK_IDENTITY_MAX + 1];
+		snprintf(identity, sizeof(identity), "openpgp-skt-%u", i + 1);
+		if (server_add_psk(identity, pskhex, sizeof(pskhex), PAIRING_LIFETIME, true)) {
+			break;
+		}
+		snprintf(urlbuf, sizeof(urlbuf)-1, "%s:%s/%d/%s%s%s%s%s", schema, info.ip, PORT, pskhex, "/SSID:", info.ssid, "/ID:", identity);
+		printf("pairing token %s, valid %d s:\n", identity, PAIRING_LIFETIME);
+		create_and_print_qr(urlbuf, stdout);
+	}
+	
 	free(info.ssid);
 	free(info.ip);
 	
 	server_fd = server_bind(PORT);
 }
 
-gpgme_key_t *list_of_keys = NULL;
-size_t number_of_keys;
+/* one per connected device, a selection always refers to what that session has been shown: cached keys never move */
+struct client_session{
+	unsigned int id;
+	int fd;
+	size_t number_of_keys; //first keys of the cache shown to this session
+	bool sending; //a key is queued, tell the user when it leaves the queue
+	struct gpgsession_stream *export; //key being exported by a worker, sent as gpg writes it
+	struct gpgsession_parser *parser; //key blocks sent by this client
+	struct gpgworker_importer *importer; //streams the blocks found by the parser to the workers
+	char *unparsed; //read while the import stream was full, parsed once it has room
+	size_t unparsed_length;
+	struct client_session *prev;
+	struct client_session *next;
+};
+
+struct client_session *sessions = NULL;
+size_t number_of_sessions = 0;
+unsigned int next_session_id = 1;
 
-void update_and_print_keys(gpgme_ctx_t *ctx) {
+struct gpgsession_keycache *keycache = NULL;
+
+void print_keys(struct client_session * const session) {
+	session->number_of_keys = gpgsession_keycache_size(keycache);
 	
-	if (list_of_keys != NULL) {
-		gpgsession_free_secret_keys(&list_of_keys, number_of_keys);
+	printf("Select a key to share with session %u (\"%u <key>\"):\n", session->id, session->id);
+	for (size_t c = 0; c < session->number_of_keys; c++) {
+		const struct gpgsession_keyinfo *key = gpgsession_keycache_get(keycache, c);
+		if (key != NULL) { //removed from the keyring meanwhile, the numbers of the others stay
+			printf("[%ld] key %s\n", c, key->fpr);
+		}
 	}
 	
-	gpgsession_gather_secret_keys(ctx, &list_of_keys, &number_of_keys);
+}
+
+struct gpgsession_pool *contexts = NULL;
+
+struct gpgworker_pool *workers = NULL;
+
+struct client_session *session_new(const int fd) {
+	struct client_session *session = calloc(1, sizeof(struct client_session));
+	if (session == NULL) {
+		perror("failed to allocate client session, out of RAM?");
+		return NULL;
+	}
+	session->id = next_session_id++;
+	session->fd = fd;
 	
-	printf("Select a key to share:\n");
-	for (size_t c = 0; c < number_of_keys; c++) {
-		printf("[%ld] key %s\n", c,  list_of_keys[c]->fpr);
+	if (gpgworker_importer_new(&session->importer, workers, session->id)) {
+		free(session);
+		return NULL;
+	}
+	if (gpgsession_parser_new(&session->parser, &gpgworker_importer_sink, session->importer)) {
+		gpgworker_importer_free(&session->importer);
+		free(session);
+		return NULL;
 	}
 	
+	session->next = sessions;
+	if (sessions != NULL) {
+		sessions->prev = session;
+	}
+	sessions = session;
+	number_of_sessions++;
+	
+	return session;
 }
 
-int send_key(gpgme_ctx_t * const ctx, gpgme_key_t key, const int fd) {
-	int rc = 0;
-	gpgme_error_t gerr = 0;
-	gpgme_export_mode_t mode = GPGME_EXPORT_MODE_MINIMAL | GPGME_EXPORT_MODE_SECRET;
-	char *pattern = NULL;
-	gpgme_data_t data = NULL;
-	
-	rc = asprintf(&pattern, "0x%s", key->fpr);
-	if (rc == -1) {
-		fprintf(stderr, "failed to malloc appropriately!\n");
-		return -1;
+void session_free(struct client_session * const session) {
+	if (session->prev != NULL) {
+		session->prev->next = session->next;
+	}else{
+		sessions = session->next;
+	}
+	if (session->next != NULL) {
+		session->next->prev = session->prev;
 	}
+	number_of_sessions--;
 	
-	/* create buffer for data exchange with gpgme*/
-	gerr = gpgme_data_new(&data);
-	if(gerr) {
-		fprintf(stderr, "failed to init data buffer: (%d) %s\n", gerr, gpgme_strerror(gerr));
-		return -1;
+	gpgsession_parser_free(&session->parser); //drop the block in progress before the importer
+	gpgworker_importer_free(&session->importer);
+	if (session->export != NULL) {
+		gpgsession_stream_done(session->export); //gpg stops writing
+		gpgsession_stream_unref(session->export);
+	}
+	free(session->unparsed);
+	free(session);
+}
+
+struct client_session *session_by_id(const uintmax_t id) {
+	for (struct client_session *session = sessions; session != NULL; session = session->next) {
+		if (session->id == id) {
+			return session;
+		}
+	}
+	return NULL;
+}
+
+struct client_session *session_find(const char * const id) {
+	char *end;
+	errno = 0;
+	uintmax_t num = strtoumax(id, &end, 10);
+	if (errno == ERANGE || end == id || *end != '\0') {
+		return NULL;
 	}
 	
-	ssize_t read_bytes;
+	return session_by_id(num);
+}
+
+void session_close(struct event_loop *loop, struct client_session * const session) {
+	struct client_stats stats;
 	
-	/* FIXME: blocking! */
-	gerr = gpgme_op_export(*ctx, pattern, mode, data);
-	free(pattern);
+	event_loop_del(loop, session->fd);
+	client_close(session->fd);
+	if (client_stats(session->fd, &stats) == 0) {
+		printf(" - session %u disconnected, received %" PRIu64 " bytes in %" PRIu64 " reads, sent %" PRIu64 " bytes in %" PRIu64 " writes, handshake %.2f ms CPU%s\n",
+			session->id, stats.bytes_in, stats.reads, stats.bytes_out, stats.writes, stats.handshake_ns / 1e6, stats.resumed ? " (resumed)" : "");
+	}else{
+		printf(" - session %u disconnected\n", session->id);
+	}
+	session_free(session);
+}
+
+#define MAX_MATCHES 10            /* keys listed when a selection is ambiguous */
+
+/* selection: position in the first shown keys, or anything gpgsession_keycache_search() understands; return -1 if not a single key */
+ssize_t resolve_key(const char * const selection, const size_t shown) {
+	size_t found[MAX_MATCHES];
+	char *end;
+	errno = 0;
+	uintmax_t num = strtoumax(selection, &end, 10);
 	
-	read_bytes = gpgme_data_seek (data, 0, SEEK_END);
-	if(read_bytes == -1) {
-		printf("data-seek-err: %s\n", gpgme_strerror(errno));
+	if (errno == 0 && end != selection && *end == '\0' && (num < shown || strlen(selection) < GPGSESSION_KEYCACHE_MIN_PREFIX)) {
+		if (num >= shown) {
+			printf("Invalid selection\n");
+			return -1;
+		}
+		if (gpgsession_keycache_get(keycache, num) == NULL) {
+			printf("Key %ju is no longer in the keyring\n", num);
+			return -1;
+		}
+		return num;
 	}
-	read_bytes = gpgme_data_seek (data, 0, SEEK_SET);
 	
-	if (gerr) {
-		gpgme_data_release(data);
-		fprintf(stderr, "failed to export key: (%d) %s\n", gerr, gpgme_strerror(gerr));
+	size_t count = gpgsession_keycache_search(keycache, selection, found, MAX_MATCHES);
+	if (count == 0) {
+		printf("No key matches \"%s\"\n", selection);
+		return -1;
+	}
+	if (count > 1) {
+		printf("%zu keys match \"%s\", be more specific:\n", count, selection);
+		for (size_t c = 0; c < count && c < MAX_MATCHES; c++) {
+			const struct gpgsession_keyinfo *key = gpgsession_keycache_get(keycache, found[c]);
+			printf("  key %s %s\n", key->fpr, key->number_of_uids ? key->uids[0] : "");
+		}
 		return -1;
 	}
+	return found[0];
+}
+
+void send_selected_key(struct client_session * const session, const char * const selection) {
+	ssize_t index = resolve_key(selection, session->number_of_keys);
+	if (index == -1) {
+		return;
+	}
+	
+	if (session->export != NULL) {
+		printf("Session %u is still receiving a key\n", session->id);
+		return;
+	}
+	
+	const char * const fpr = gpgsession_keycache_get(keycache, index)->fpr;
+	printf("Sending key %s to session %u\n", fpr, session->id);
+	
+	/* the export run on a worker, its output is sent as it comes, see session_send() */
+	struct gpgworker_job *job = gpgworker_job_export(workers, fpr, session->id, &session->export);
+	if (job == NULL) {
+		printf("Error\n");
+		return;
+	}
+	if (gpgworker_submit(workers, job)) {
+		gpgworker_job_free(job);
+		gpgsession_stream_unref(session->export);
+		session->export = NULL;
+		printf("Error\n");
+		return;
+	}
+	session->sending = true;
+	client_hold(session->fd); //full records until the key is complete
+}
+
+/* move what gpg exported to TLS, as long as the socket keeps up; return -1 if the client is gone, the session is closed then */
+int session_send(struct event_loop *loop, struct client_session * const session) {
+	char buffer[READ_BUFFER];
 	
-	/* write keys to stderr */
-	char buf[1000];
-	while ((read_bytes = gpgme_data_read (data, buf, sizeof(buf))) > 0) {
-		ssize_t written = client_write(fd, buf, read_bytes); /* FIXME: blocking */
-		if (written != read_bytes) {
-			fprintf(stderr, "failed to wite key\n");
-			gpgme_data_release(data);
+	while (session->export != NULL) {
+		int pending = client_pending(session->fd);
+		if (pending == -1) {
+			printf("Error sending key to session %u\n", session->id);
+			session_close(loop, session); //the TLS side closed the fd, it may be reused by the next client
+			return -1;
+		}
+		if (pending >= SEND_QUEUE) {
+			return 0; //on_client() calls again once the socket is writable
+		}
+		
+		ssize_t n = gpgsession_stream_read(session->export, buffer, sizeof(buffer));
+		if (n == 0) {
+			return 0; //gpg is still working, the completion fd tells when there is more
+		}
+		if (n == -1) {
+			bool complete = errno != EIO;
+			gpgsession_stream_unref(session->export);
+			session->export = NULL;
+			client_release(session->fd);
+			if (!complete) {
+				session->sending = false;
+				printf("Error sending key to session %u\n", session->id);
+			}
+			break;
+		}
+		if (client_write(session->fd, buffer, n) != n) {
+			printf("Error sending key to session %u\n", session->id);
+			session_close(loop, session); //stops gpg writing the export too
 			return -1;
 		}
 	}
 	
-	if (read_bytes < 0) {
-		fprintf(stderr, "failed to read key: (%d) %s\n", gerr, gpgme_strerror(gerr));
+	if (session->sending && client_pending(session->fd) == 0) {
+		session->sending = false;
+		printf("Sent key to session %u\n", session->id);
 	}
-	
-	gpgme_data_release(data);
 	return 0;
 }
 
-void loop() {
-	fd_set rfds;
-	struct timeval tv;
-	int retval;
+const char *validity_string(const gpgme_validity_t validity) {
+	switch (validity) {
+		case GPGME_VALIDITY_NEVER: return "never";
+		case GPGME_VALIDITY_MARGINAL: return "marginal";
+		case GPGME_VALIDITY_FULL: return "full";
+		case GPGME_VALIDITY_ULTIMATE: return "ultimate";
+		default: return "unknown";
+	}
+}
+
+void print_details(const gpgme_key_t key) {
+	printf("key %s%s%s\n", key->fpr, key->revoked ? " revoked" : "", key->expired ? " expired" : "");
+	for (gpgme_user_id_t uid = key->uids; uid != NULL; uid = uid->next) {
+		printf("  uid [%s] %s%s\n", validity_string(uid->validity), uid->uid ? uid->uid : "", uid->revoked ? " revoked" : "");
+	}
+	for (gpgme_subkey_t subkey = key->subkeys; subkey != NULL; subkey = subkey->next) {
+		printf("  sub %s created %ld expires %ld%s%s%s\n", subkey->keyid ? subkey->keyid : "?", subkey->timestamp, subkey->expires,
+			subkey->secret ? " secret" : "", subkey->revoked ? " revoked" : "", subkey->expired ? " expired" : "");
+	}
+}
+
+/* the details are only asked to gpg here, listing keys does not need them; a worker fetches them, see on_gpg_done() */
+void print_key_details(const char * const selection) {
+	ssize_t index = resolve_key(selection, gpgsession_keycache_size(keycache));
+	if (index == -1) {
+		return;
+	}
+	
+	gpgme_key_t key = gpgsession_keycache_details(keycache, index);
+	if (key != NULL) {
+		print_details(key);
+		return;
+	}
 	
-	int client_fd = -1;
+	struct gpgworker_job *job = gpgworker_job_details(gpgsession_keycache_get(keycache, index)->fpr, 0);
+	if (job == NULL || gpgworker_submit(workers, job)) {
+		gpgworker_job_free(job);
+		printf("Error\n");
+	}
+}
+
+void print_help(void) {
+	printf("Commands:\n");
+	printf("  list                list connected sessions\n");
+	printf("  keys <session>      show the keys offered to a session\n");
+	printf("  <session> <key>     send a key to a session (also \"send <session> <key>\")\n");
+	printf("                      <key> is its number, a fingerprint (prefix), key ID, keygrip or part of a user ID\n");
+	printf("  <key>               send a key, when only one session is connected\n");
+	printf("  info <key>          details of a key\n");
+	printf("  close <session>     disconnect a session\n");
+}
+
+void handle_command(struct event_loop *loop, char * const line) {
+	char *saveptr = NULL;
+	char *argv[4] = {0};
+	int argc = 0;
 	
-	int is_running = 1;
+	for (char *tok = strtok_r(line, " \t\r", &saveptr); tok != NULL && argc < 4; tok = strtok_r(NULL, " \t\r", &saveptr)) {
+		argv[argc++] = tok;
+	}
 	
-	gpgme_ctx_t ctx;
-	if (gpgsession_new(&ctx, false) != 0) {
-		fprintf(stderr, "failed to generate gpg session\n");
+	if (argc == 0) {
 		return;
 	}
 	
-	while (is_running) {
-		/* Wait up to five seconds. */
-		tv.tv_sec = 5;
-		tv.tv_usec = 0;
+	if (strcmp(argv[0], "send") == 0) {
+		memmove(argv, argv + 1, sizeof(argv) - sizeof(argv[0]));
+		argv[3] = NULL;
+		argc--;
+		if (argc == 0) {
+			printf("Invalid command\n");
+			return;
+		}
+	}
 	
-		/* Watch server to see when it has input. */
-		FD_ZERO(&rfds);
-		if (server_fd == -1) {
-			printf("Impossible to bind the server port\n");
-			exit(-1);
+	if (strcmp(argv[0], "help") == 0) {
+		print_help();
+	}else if (strcmp(argv[0], "list") == 0 && argc == 1) {
+		printf("%zu session(s) connected\n", number_of_sessions);
+		for (struct client_session *session = sessions; session != NULL; session = session->next) {
+			printf("[%u] %zu key(s) offered\n", session->id, session->number_of_keys);
+		}
+	}else if (strcmp(argv[0], "keys") == 0 && argc == 2) {
+		struct client_session *session = session_find(argv[1]);
+		if (session == NULL) {
+			printf("Invalid session\n");
+			return;
+		}
+		print_keys(session);
+	}else if (strcmp(argv[0], "info") == 0 && argc == 2) {
+		print_key_details(argv[1]);
+	}else if (strcmp(argv[0], "close") == 0 && argc == 2) {
+		struct client_session *session = session_find(argv[1]);
+		if (session == NULL) {
+			printf("Invalid session\n");
+			return;
+		}
+		session_close(loop, session);
+	}else if (argc == 2) {
+		struct client_session *session = session_find(argv[0]);
+		if (session == NULL) {
+			printf("Invalid session\n");
+			return;
+		}
+		send_selected_key(session, argv[1]);
+	}else if (argc == 1) {
+		if (number_of_sessions != 1) {
+			printf("%zu sessions connected, use \"<session> <key>\"\n", number_of_sessions);
+			return;
+		}
+		send_selected_key(sessions, argv[0]);
+	}else{
+		printf("Invalid command\n");
+	}
+}
+
+void on_stdin(struct event_loop *loop, int fd, uint32_t events, void *userdata) {
+	static char line[256];
+	static size_t line_len = 0;
+	
+	/* level triggered: one read per wakeup, stdin is left in blocking mode for the terminal sake */
+	ssize_t ris = read(fd, line + line_len, sizeof(line) - 1 - line_len);
+	if (ris <= 0) {
+		if (ris == -1 && errno == EINTR) {
+			return;
+		}
+		printf(" - stdin closed, no more commands\n");
+		event_loop_del(loop, fd);
+		return;
+	}
+	line_len += ris;
+	
+	//execute every complete line
+	char *start = line;
+	char *newline;
+	while ((newline = memchr(start, '\n', line_len - (start - line))) != NULL) {
+		*newline = '\0';
+		handle_command(loop, start);
+		start = newline + 1;
+	}
+	line_len -= start - line;
+	memmove(line, start, line_len);
+	
+	if (line_len == sizeof(line) - 1) {
+		printf("Invalid command\n");
+		line_len = 0;
+	}
+}
+
+void on_client(struct event_loop *loop, int fd, uint32_t events, void *userdata);
+
+/* feed the parser, keep what the import stream had no room for: return false if the session is paused */
+bool session_parse(struct client_session * const session, const char * const data, const size_t length) {
+	ssize_t consumed = gpgsession_parser_feed(session->parser, data, length);
+	if (consumed < 0 || (size_t)consumed == length) {
+		return true;
+	}
+	
+	size_t rest = length - consumed;
+	if (session->unparsed == NULL) {
+		session->unparsed = malloc(READ_BUFFER);
+		if (session->unparsed == NULL) {
+			perror("failed to allocate read buffer, out of RAM?");
+			gpgsession_parser_flush(session->parser);
+			return true;
+		}
+	}
+	memmove(session->unparsed, data + consumed, rest);
+	session->unparsed_length = rest;
+	return false;
+}
+
+/* a worker made room in some import stream, give the paused sessions another try */
+void resume_sessions(struct event_loop *loop) {
+	struct client_session *next;
+	
+	for (struct client_session *session = sessions; session != NULL; session = next) {
+		next = session->next; //on_client may close the session
+		if (session->unparsed_length == 0) {
+			continue;
 		}
-		FD_SET(server_fd, &rfds);
-		
-		/* Watch stdin (fd 0) to see when it has input. */
-		FD_SET(STDIN_FILENO, &rfds);
 		
-		/* Watch client to see when it has input. */
-		if (client_fd != -1) {
-			//set back
-			FD_SET(client_fd, &rfds);
+		size_t length = session->unparsed_length;
+		session->unparsed_length = 0;
+		if (session_parse(session, session->unparsed, length)) {
+			//the edge that came in while paused is gone, read what is waiting
+			on_client(loop, session->fd, EPOLLIN, session);
+		}
+	}
+}
+
+int batch_timer = -1;
+bool batch_armed = false;
+
+/* the first complete key starts the window, the ones that follow join its batch */
+void arm_batch_timer(void) {
+	if (batch_armed) {
+		return;
+	}
+	
+	struct itimerspec when = { .it_value = { .tv_sec = 0, .tv_nsec = IMPORT_BATCH_MS * 1000000L } };
+	if (timerfd_settime(batch_timer, 0, &when, NULL)) {
+		perror("failed to arm the import batch timer");
+		return;
+	}
+	batch_armed = true;
+}
+
+void on_batch_timer(struct event_loop *loop, int fd, uint32_t events, void *userdata) {
+	uint64_t expirations;
+	
+	if (read(fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN) {
+		perror("failed to read the import batch timer");
+	}
+	batch_armed = false;
+	
+	for (struct client_session *session = sessions; session != NULL; session = session->next) {
+		if (gpgworker_importer_pending(session->importer)) {
+			gpgworker_importer_flush(session->importer);
 		}
+	}
+}
+
+/* one line per key, gpg gives a secret key twice (public and secret part) */
+void print_import(const struct gpgworker_job * const job) {
+	for (size_t i = 0; i < job->number_of_imports; i++) {
+		const struct gpgsession_import_status * const status = &job->imports[i];
+		const char * const fpr = status->fpr ? status->fpr : "(unknown)";
 		
-		retval = select(FD_SETSIZE, &rfds, NULL, NULL, &tv);
-		/* Don't rely on the value of tv now! */
+		if (i > 0 && job->imports[i - 1].fpr != NULL && status->fpr != NULL && strcmp(job->imports[i - 1].fpr, status->fpr) == 0) {
+			continue;
+		}
+		if (status->result == 0) {
+			printf(" - session %u sent key %s\n", job->tag, fpr);
+		}else{
+			printf(" - session %u sent key %s, not imported: %s\n", job->tag, fpr, gpgme_strerror(status->result));
+		}
+	}
+}
+
+/* printed as gpg lists them, the first ones show up before the keyring is fully read */
+void print_loaded_key(void * const opaque, const size_t index) {
+	const struct gpgsession_keyinfo *key = gpgsession_keycache_get(keycache, index);
+	printf("[%zu] key %s %s\n", index, key->fpr, key->number_of_uids ? key->uids[0] : "");
+}
+
+struct gpgsession_watch *keyring_watch = NULL;
+int reload_timer = -1;
+struct gpgsession_keyring_stamp keyring_stamp; //the keyring files as the cache knows them: last listing, then our own imports
+bool reload_deferred = false; //the keyring settled while we were importing, look again once the imports are done
+bool listing = false; //a worker lists the keyring
+
+/* list the keyring again on a worker, unless only our own imports changed it */
+void reload_keyring(void) {
+	struct gpgsession_keyring_stamp now;
+	
+	if (listing) {
+		return; //looked at again once the listing is done
+	}
+	gpgsession_keyring_stamp(gpgsession_pool_home(contexts), &now);
+	if (gpgsession_keyring_stamp_equal(&now, &keyring_stamp)) {
+		return;
+	}
+	
+	struct gpgworker_job *job = gpgworker_job_list(0);
+	if (job == NULL || gpgworker_submit(workers, job)) {
+		gpgworker_job_free(job);
+		fprintf(stderr, "failed to list the secret keys again\n");
+		return;
+	}
+	listing = true;
+}
+
+/* a gpg run touches several files, wait for the last one before listing */
+void on_keyring_change(struct event_loop *loop, int fd, uint32_t events, void *userdata) {
+	if (gpgsession_watch_changed(keyring_watch) != 1) {
+		return;
+	}
+	
+	struct itimerspec when = { .it_value = { .tv_sec = 0, .tv_nsec = KEYRING_SETTLE_MS * 1000000L } };
+	if (timerfd_settime(reload_timer, 0, &when, NULL)) {
+		perror("failed to arm the keyring reload timer");
+	}
+}
+
+void on_reload_timer(struct event_loop *loop, int fd, uint32_t events, void *userdata) {
+	uint64_t expirations;
+	
+	if (read(fd, &expirations, sizeof(expirations)) == -1) {
+		if (errno != EAGAIN) {
+			perror("failed to read the keyring reload timer");
+		}
+		return;
+	}
+	
+	if (gpgworker_importing(workers)) {
+		reload_deferred = true; //the changes may be theirs, see on_gpg_done()
+		return;
+	}
+	reload_keyring();
+}
+
+void on_gpg_done(struct event_loop *loop, int fd, uint32_t events, void *userdata) {
+	struct gpgworker_job *job;
+	
+	gpgworker_ack(workers);
+	while ((job = gpgworker_next_completed(workers)) != NULL) {
+		struct client_session *session = session_by_id(job->tag);
+		if (session == NULL && job->type == GPGWORKER_EXPORT) {
+			//the client went away in the meantime
+			gpgworker_job_free(job);
+			continue;
+		}
 		
-		if (retval == -1){
-			perror("select()");
-			is_running = 0;
-		}else if (retval){
-			
-			//listen for user input
-			if (FD_ISSET(STDIN_FILENO, &rfds)) {
-				static char line[256];
-				
-				if(fgets(line, sizeof line, stdin) != NULL) {
-					char *end;
-					uintmax_t num = strtoumax(line, &end, 10);
-					
-					if (errno == ERANGE || *end != '\n'){
-						printf("Invalid command\n");
-					}else if (num >= number_of_keys) {
-						printf("Invalid selection\n");
-					}else if(client_fd != -1) {
-						printf("Sending key %s\n", list_of_keys[num]->fpr);
-						int err = send_key(&ctx, list_of_keys[num], client_fd);
-						if (!err) {
-							printf("Sent\n");
-						}else{
-							printf("Error\n");
-						}
-					}
+		switch (job->type) {
+			case GPGWORKER_EXPORT:
+				break; //the stream tells how it went, see session_send()
+			case GPGWORKER_IMPORT:
+				print_import(job); //even if the client is gone, its keys are in the keyring
+				//only the imported keys, listed by the worker, not the whole keyring
+				if (gpgsession_keycache_update(keycache, job->keys, job->number_of_keys) > 0 && session != NULL) {
+					print_keys(session);
 				}
-			}
-			
-			//listen for new connection
-			if (FD_ISSET(server_fd, &rfds)) {
-				//only one connection at time
-				if (client_fd != -1){
-					printf(" - forcing client disconnect for a new client\n");
-					client_close(client_fd);
-					client_fd = -1;
+				if (gpgsession_keyring_stamp_equal(&job->before, &keyring_stamp)) {
+					keyring_stamp = job->after; //nobody else wrote it meanwhile, what changed is this import
 				}
-				
-				client_fd = server_accept();
-				printf(" - client connected\n");
-				update_and_print_keys(&ctx);
-			}
-			
-			//if client connected, check for input
-			if (client_fd != -1 && FD_ISSET(client_fd, &rfds)){
-				uint8_t buff[100];
-				int ris;
-				do{
-					ris = client_update( client_fd, buff, sizeof(buff) );
-					if (ris == -1) {
-						client_fd = -1;
-						printf(" - client disconnected\n");
-					}else{
-						if ( gpgsession_add_data(&ctx, (const char * const)buff, ris ) ) { // we imported a new key
-							printf(" - client sent a key\n");
-							update_and_print_keys(&ctx);
-						}
-					}
-				}while(ris > 0);
-			}
-		}else{
-			//printf("No data within five seconds.\n");
+				break;
+			case GPGWORKER_LIST:
+				listing = false;
+				if (job->result) {
+					fprintf(stderr, "failed to list the secret keys again\n");
+					break;
+				}
+				gpgsession_keycache_refresh(keycache, job->keys, job->number_of_keys, print_loaded_key, NULL);
+				keyring_stamp = job->before;
+				reload_keyring(); //changed again while listed
+				break;
+			case GPGWORKER_DETAILS:
+				if (job->details == NULL) {
+					printf("Error: gpg has no details for key %s\n", job->fpr);
+					break;
+				}
+				print_details(job->details);
+				if (gpgsession_keyring_stamp_equal(&job->before, &keyring_stamp)) {
+					gpgsession_keycache_set_details(keycache, job->details); //fetched from the keyring the cache lists
+					job->details = NULL;
+				}
+				break;
+		}
+		gpgworker_job_free(job);
+	}
+	
+	if (reload_deferred && !gpgworker_importing(workers)) {
+		reload_deferred = false;
+		reload_keyring();
+	}
+	
+	/* the same fd tells that exports have more data */
+	struct client_session *next;
+	for (struct client_session *session = sessions; session != NULL; session = next) {
+		next = session->next; //a client gone while sending is closed
+		session_send(loop, session);
+	}
+	resume_sessions(loop);
+}
+
+void on_client(struct event_loop *loop, int fd, uint32_t events, void *userdata) {
+	struct client_session *session = userdata;
+	uint8_t buff[READ_BUFFER];
+	int ris;
+	
+	if (events & EPOLLOUT && client_flush(fd) != -1 && session_send(loop, session)) {
+		return;
+	}
+	
+	if (session->unparsed_length > 0) {
+		return; //paused until a worker drains the import stream, the data waits in the socket
+	}
+	
+	/* edge triggered: keep going until the TLS layer has nothing more for us */
+	do{
+		ris = client_update( fd, buff, sizeof(buff) );
+		if (ris == -1) {
+			session_close(loop, session);
+			return;
 		}
+		if (ris > 0 && !session_parse(session, (const char * const)buff, ris)) {
+			break; //complete keys are imported by the workers, wait for room
+		}
+	}while(ris > 0);
+	
+	if (gpgworker_importer_pending(session->importer)) {
+		arm_batch_timer(); //more keys may be on their way
+	}
+}
+
+void on_server(struct event_loop *loop, int fd, uint32_t events, void *userdata) {
+	int new_fd;
+	
+	/* edge triggered: accept until the backlog is empty */
+	while ((new_fd = server_accept()) != -1) {
+		if (new_fd < 0) {
+			continue; //refused, try the next one
+		}
+		
+		struct client_session *session = session_new(new_fd);
+		if (session == NULL) {
+			client_close(new_fd);
+			continue;
+		}
+		
+		if (event_loop_add(loop, new_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, on_client, session)) {
+			client_close(new_fd);
+			session_free(session);
+			continue;
+		}
+		
+		printf(" - client connected as session %u\n", session->id);
+		print_keys(session);
+		
+		//the client may have sent the ClientHello already, the edge is gone
+		on_client(loop, new_fd, EPOLLIN, session);
+	}
+}
+
+void loop() {
+	struct event_loop *loop = NULL;
+	
+	if (server_fd == -1) {
+		printf("Impossible to bind the server port\n");
+		exit(-1);
+	}
+	
+	/* one context per worker plus one for the key listing, gpgme is initialized here before starting other threads */
+	if (gpgsession_pool_new(&contexts, GPG_WORKERS + 1, false) != 0) {
+		fprintf(stderr, "failed to generate gpg session\n");
+		return;
+	}
+	
+	/* the keyring is enumerated once, imports then update the cache key by key and other changes are watched */
+	if (gpgsession_keycache_new(&keycache)) {
+		goto end;
+	}
+	printf("Secret keys:\n");
+	gpgsession_keyring_stamp(gpgsession_pool_home(contexts), &keyring_stamp);
+	gpgme_ctx_t *ctx = gpgsession_pool_acquire(contexts);
+	int rc = gpgsession_keycache_load(keycache, ctx, gpgsession_pool_home(contexts), print_loaded_key, NULL);
+	gpgsession_pool_release(contexts, ctx);
+	if (rc) {
+		fprintf(stderr, "failed to list the secret keys\n");
+		goto end;
+	}
+	
+	if (gpgworker_pool_new(&workers, GPG_WORKERS, contexts)) {
+		fprintf(stderr, "failed to start gpg workers\n");
+		goto end;
+	}
+	
+	if (event_loop_new(&loop)) {
+		fprintf(stderr, "failed to create event loop\n");
+		goto end;
+	}
+	
+	if (event_loop_add(loop, server_fd, EPOLLIN | EPOLLET, on_server, NULL) ||
+		event_loop_add(loop, STDIN_FILENO, EPOLLIN, on_stdin, NULL) ||
+		event_loop_add(loop, gpgworker_completion_fd(workers), EPOLLIN | EPOLLET, on_gpg_done, NULL)) {
+		goto end;
+	}
+	
+	batch_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (batch_timer == -1) {
+		perror("timerfd_create()");
+		goto end;
+	}
+	if (event_loop_add(loop, batch_timer, EPOLLIN, on_batch_timer, NULL)) {
+		goto end;
+	}
+	
+	/* without it keys added by another gpg only show up after a restart */
+	if (gpgsession_watch_new(&keyring_watch, gpgsession_pool_home(contexts)) == 0) {
+		reload_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (reload_timer == -1) {
+			perror("timerfd_create()");
+			goto end;
+		}
+		if (event_loop_add(loop, gpgsession_watch_fd(keyring_watch), EPOLLIN, on_keyring_change, NULL) ||
+			event_loop_add(loop, reload_timer, EPOLLIN, on_reload_timer, NULL)) {
+			goto end;
+		}
+	}
+	
+	event_loop_run(loop);
+	
+	end:
+	event_loop_free(&loop);
+	if (batch_timer != -1) {
+		close(batch_timer);
+	}
+	if (reload_timer != -1) {
+		close(reload_timer);
 	}
+	gpgsession_watch_free(&keyring_watch);
+	gpgworker_pool_free(&workers);
+	gpgsession_keycache_free(&keycache);
+	gpgsession_pool_free(&contexts);
 }
 
 int main(void) {
@@ -230,7 +829,11 @@ int main(void) {
 	
 	loop();
 	
-	printf("server closing\n");
+	struct handshake_stats handshakes;
+	server_handshake_stats(&handshakes);
+	printf("server closing, handshakes: %" PRIu64 " full (%.2f ms CPU each), %" PRIu64 " resumed (%.2f ms), %" PRIu64 " failed\n",
+		handshakes.full, handshakes.full ? handshakes.full_ns / 1e6 / handshakes.full : 0.0,
+		handshakes.resumed, handshakes.resumed ? handshakes.resumed_ns / 1e6 / handshakes.resumed : 0.0, handshakes.failed);
 	server_close();
 	
 	return 0;
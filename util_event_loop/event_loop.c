@@ -0,0 +1,212 @@
+#include "util_event_loop/event_loop.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 64
+
+struct event_handler{
+	int fd;
+	bool alive;
+	event_callback callback;
+	void *userdata;
+	struct event_handler *next_dead; //handler removed while dispatching, freed at the end of the batch
+};
+
+struct event_loop{
+	int epoll_fd;
+	bool is_running;
+	bool dispatching;
+	
+	struct event_handler **handlers; //indexed by fd
+	size_t handlers_size;
+	
+	struct event_handler *dead;
+};
+
+int event_loop_new(struct event_loop **loop) {
+	if (loop == NULL) {
+		fprintf(stderr, "event loop must be not null\n");
+		return -1;
+	}
+	
+	*loop = calloc(1, sizeof(struct event_loop));
+	if (*loop == NULL) {
+		perror("failed to allocate event loop, out of RAM?");
+		return -1;
+	}
+	
+	(*loop)->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if ((*loop)->epoll_fd == -1) {
+		perror("epoll_create1()");
+		free(*loop);
+		*loop = NULL;
+		return -1;
+	}
+	
+	return 0;
+}
+
+static void free_dead_handlers(struct event_loop *loop) {
+	while (loop->dead != NULL) {
+		struct event_handler *next = loop->dead->next_dead;
+		free(loop->dead);
+		loop->dead = next;
+	}
+}
+
+void event_loop_free(struct event_loop **loop) {
+	if (loop == NULL || *loop == NULL) {
+		return;
+	}
+	
+	for (size_t fd = 0; fd < (*loop)->handlers_size; fd++) {
+		free((*loop)->handlers[fd]);
+	}
+	free((*loop)->handlers);
+	free_dead_handlers(*loop);
+	
+	close((*loop)->epoll_fd);
+	free(*loop);
+	*loop = NULL;
+}
+
+static int grow_handlers(struct event_loop *loop, const int fd) {
+	if ((size_t)fd < loop->handlers_size) {
+		return 0;
+	}
+	
+	size_t size = loop->handlers_size ? loop->handlers_size : 64;
+	while (size <= (size_t)fd) {
+		size *= 2;
+	}
+	
+	struct event_handler **tmp = realloc(loop->handlers, sizeof(struct event_handler *) * size);
+	if (tmp == NULL) {
+		perror("failed to grow event handlers, out of RAM?");
+		return -1;
+	}
+	memset(tmp + loop->handlers_size, 0, sizeof(struct event_handler *) * (size - loop->handlers_size));
+	
+	loop->handlers = tmp;
+	loop->handlers_size = size;
+	return 0;
+}
+
+int event_loop_add(struct event_loop *loop, const int fd, const uint32_t events, event_callback callback, void *userdata) {
+	if (fd < 0 || callback == NULL) {
+		fprintf(stderr, "invalid fd %d or callback for event loop\n", fd);
+		return -1;
+	}
+	
+	if (grow_handlers(loop, fd)) {
+		return -1;
+	}
+	
+	if (loop->handlers[fd] != NULL) {
+		//stale handler of a fd that was closed without being removed, the number has been reused
+		event_loop_del(loop, fd);
+	}
+	
+	struct event_handler *handler = malloc(sizeof(struct event_handler));
+	if (handler == NULL) {
+		perror("failed to allocate event handler, out of RAM?");
+		return -1;
+	}
+	handler->fd = fd;
+	handler->alive = true;
+	handler->callback = callback;
+	handler->userdata = userdata;
+	handler->next_dead = NULL;
+	
+	struct epoll_event ev = { .events = events, .data.ptr = handler };
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		fprintf(stderr, "failed to watch fd %d: (%d) %s\n", fd, errno, strerror(errno));
+		free(handler);
+		return -1;
+	}
+	
+	loop->handlers[fd] = handler;
+	return 0;
+}
+
+int event_loop_mod(struct event_loop *loop, const int fd, const uint32_t events) {
+	if (fd < 0 || (size_t)fd >= loop->handlers_size || loop->handlers[fd] == NULL) {
+		fprintf(stderr, "fd %d is not watched by the event loop\n", fd);
+		return -1;
+	}
+	
+	struct epoll_event ev = { .events = events, .data.ptr = loop->handlers[fd] };
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+		fprintf(stderr, "failed to modify watch of fd %d: (%d) %s\n", fd, errno, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int event_loop_del(struct event_loop *loop, const int fd) {
+	if (fd < 0 || (size_t)fd >= loop->handlers_size || loop->handlers[fd] == NULL) {
+		return 0;
+	}
+	
+	/* a closed fd is already gone from the epoll set, so EBADF and ENOENT are fine */
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL) == -1 && errno != EBADF && errno != ENOENT) {
+		fprintf(stderr, "failed to unwatch fd %d: (%d) %s\n", fd, errno, strerror(errno));
+	}
+	
+	struct event_handler *handler = loop->handlers[fd];
+	loop->handlers[fd] = NULL;
+	
+	if (loop->dispatching) {
+		//may still be referenced by a pending event of the current batch
+		handler->alive = false;
+		handler->next_dead = loop->dead;
+		loop->dead = handler;
+	}else{
+		free(handler);
+	}
+	return 0;
+}
+
+int event_loop_run_once(struct event_loop *loop, const int timeout_ms) {
+	struct epoll_event events[MAX_EVENTS];
+	
+	int ready = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, timeout_ms);
+	if (ready == -1) {
+		if (errno == EINTR) {
+			return 0;
+		}
+		perror("epoll_wait()");
+		return -1;
+	}
+	
+	loop->dispatching = true;
+	for (int i = 0; i < ready; i++) {
+		struct event_handler *handler = events[i].data.ptr;
+		if (handler->alive) {
+			handler->callback(loop, handler->fd, events[i].events, handler->userdata);
+		}
+	}
+	loop->dispatching = false;
+	
+	free_dead_handlers(loop);
+	
+	return ready;
+}
+
+int event_loop_run(struct event_loop *loop) {
+	loop->is_running = true;
+	
+	while (loop->is_running) {
+		if (event_loop_run_once(loop, -1) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void event_loop_stop(struct event_loop *loop) {
+	loop->is_running = false;
+}
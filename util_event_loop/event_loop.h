@@ -0,0 +1,35 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/epoll.h>
+
+/* 
+ * Minimal epoll based event loop: every watched fd get its own callback,
+ * dispatch cost is proportional to the number of ready fds.
+ */
+
+struct event_loop;
+
+/* called with the epoll event mask (EPOLLIN, EPOLLOUT, EPOLLHUP...) that woke up the fd */
+typedef void (*event_callback)(struct event_loop *loop, int fd, uint32_t events, void *userdata);
+
+int event_loop_new(struct event_loop **loop);
+void event_loop_free(struct event_loop **loop);
+
+/* events is an epoll mask, add EPOLLET for edge triggered fd (the callback MUST then drain the fd until EAGAIN) */
+int event_loop_add(struct event_loop *loop, const int fd, const uint32_t events, event_callback callback, void *userdata);
+int event_loop_mod(struct event_loop *loop, const int fd, const uint32_t events);
+/* safe to call from inside a callback, also for fd already closed */
+int event_loop_del(struct event_loop *loop, const int fd);
+
+/* wait up to timeout_ms (-1 forever) and dispatch ready fds, return number of dispatched events or -1 */
+int event_loop_run_once(struct event_loop *loop, const int timeout_ms);
+
+/* run until event_loop_stop() is called */
+int event_loop_run(struct event_loop *loop);
+void event_loop_stop(struct event_loop *loop);
+
+#endif
@@ -0,0 +1,77 @@
+#include "util_event_loop/event_loop.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#define PIPES 4
+
+int pipes[PIPES][2];
+int calls[PIPES] = {0};
+
+void on_readable(struct event_loop *loop, int fd, uint32_t events, void *userdata) {
+	const int id = *(int *)userdata;
+	char buf[16];
+	
+	//edge triggered: drain until EAGAIN
+	while (read(fd, buf, sizeof(buf)) > 0) {
+	}
+	calls[id]++;
+	
+	//removing another fd of the same batch must not dispatch it anymore
+	if (id == 0) {
+		event_loop_del(loop, pipes[1][0]);
+		close(pipes[1][0]);
+	}
+	if (id == PIPES - 1) {
+		event_loop_stop(loop);
+	}
+}
+
+int main(void) {
+	struct event_loop *loop = NULL;
+	int ids[PIPES];
+	
+	if (event_loop_new(&loop)) {
+		fprintf(stderr, "failed to create event loop\n");
+		return -1;
+	}
+	
+	for (int i = 0; i < PIPES; i++) {
+		ids[i] = i;
+		if (pipe2(pipes[i], O_NONBLOCK)) {
+			perror("pipe2");
+			return -1;
+		}
+		if (event_loop_add(loop, pipes[i][0], EPOLLIN | EPOLLET, on_readable, &ids[i])) {
+			return -1;
+		}
+	}
+	
+	//nothing to read, must time out without calling anybody
+	if (event_loop_run_once(loop, 10) != 0) {
+		fprintf(stderr, "unexpected event on idle loop\n");
+		return -1;
+	}
+	
+	for (int i = 0; i < PIPES; i++) {
+		if (write(pipes[i][1], "x", 1) != 1) {
+			perror("write");
+			return -1;
+		}
+	}
+	
+	if (event_loop_run(loop)) {
+		fprintf(stderr, "event loop failed\n");
+		return -1;
+	}
+	
+	printf("calls: %d %d %d %d\n", calls[0], calls[1], calls[2], calls[3]);
+	if (calls[0] != 1 || calls[1] > 1 || calls[2] != 1 || calls[3] != 1) {
+		fprintf(stderr, "unexpected dispatch count\n");
+		return -1;
+	}
+	
+	event_loop_free(&loop);
+	return 0;
+}
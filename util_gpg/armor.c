@@ -0,0 +1,339 @@
+#include "util_gpg/armor.h"
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define ARMOR_HAVE_AVX2 1
+#endif
+
+/* 1 for every valid radix-64 byte, newline included */
+static const uint8_t radix64_table[256] = {
+	['\n'] = 1, ['+'] = 1, ['/'] = 1, ['='] = 1,
+	['0'] = 1, ['1'] = 1, ['2'] = 1, ['3'] = 1, ['4'] = 1, ['5'] = 1, ['6'] = 1, ['7'] = 1, ['8'] = 1, ['9'] = 1,
+	['A'] = 1, ['B'] = 1, ['C'] = 1, ['D'] = 1, ['E'] = 1, ['F'] = 1, ['G'] = 1, ['H'] = 1, ['I'] = 1, ['J'] = 1, ['K'] = 1, ['L'] = 1, ['M'] = 1,
+	['N'] = 1, ['O'] = 1, ['P'] = 1, ['Q'] = 1, ['R'] = 1, ['S'] = 1, ['T'] = 1, ['U'] = 1, ['V'] = 1, ['W'] = 1, ['X'] = 1, ['Y'] = 1, ['Z'] = 1,
+	['a'] = 1, ['b'] = 1, ['c'] = 1, ['d'] = 1, ['e'] = 1, ['f'] = 1, ['g'] = 1, ['h'] = 1, ['i'] = 1, ['j'] = 1, ['k'] = 1, ['l'] = 1, ['m'] = 1,
+	['n'] = 1, ['o'] = 1, ['p'] = 1, ['q'] = 1, ['r'] = 1, ['s'] = 1, ['t'] = 1, ['u'] = 1, ['v'] = 1, ['w'] = 1, ['x'] = 1, ['y'] = 1, ['z'] = 1,
+};
+
+/* value of every radix-64 digit, 0xFF for anything else */
+static const uint8_t radix64_value[256] = {
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x3E, 0xFF, 0xFF, 0xFF, 0x3F,
+	0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E,
+	0x0F, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2A, 0x2B, 0x2C, 0x2D, 0x2E, 0x2F, 0x30, 0x31, 0x32, 0x33, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+};
+
+/* CRC-24 (RFC 4880 6.1) of every byte value, polynomial 0x1864CFB */
+static const uint32_t crc24_table[256] = {
+	0x000000, 0x864CFB, 0x8AD50D, 0x0C99F6, 0x93E6E1, 0x15AA1A, 0x1933EC, 0x9F7F17,
+	0xA18139, 0x27CDC2, 0x2B5434, 0xAD18CF, 0x3267D8, 0xB42B23, 0xB8B2D5, 0x3EFE2E,
+	0xC54E89, 0x430272, 0x4F9B84, 0xC9D77F, 0x56A868, 0xD0E493, 0xDC7D65, 0x5A319E,
+	0x64CFB0, 0xE2834B, 0xEE1ABD, 0x685646, 0xF72951, 0x7165AA, 0x7DFC5C, 0xFBB0A7,
+	0x0CD1E9, 0x8A9D12, 0x8604E4, 0x00481F, 0x9F3708, 0x197BF3, 0x15E205, 0x93AEFE,
+	0xAD50D0, 0x2B1C2B, 0x2785DD, 0xA1C926, 0x3EB631, 0xB8FACA, 0xB4633C, 0x322FC7,
+	0xC99F60, 0x4FD39B, 0x434A6D, 0xC50696, 0x5A7981, 0xDC357A, 0xD0AC8C, 0x56E077,
+	0x681E59, 0xEE52A2, 0xE2CB54, 0x6487AF, 0xFBF8B8, 0x7DB443, 0x712DB5, 0xF7614E,
+	0x19A3D2, 0x9FEF29, 0x9376DF, 0x153A24, 0x8A4533, 0x0C09C8, 0x00903E, 0x86DCC5,
+	0xB822EB, 0x3E6E10, 0x32F7E6, 0xB4BB1D, 0x2BC40A, 0xAD88F1, 0xA11107, 0x275DFC,
+	0xDCED5B, 0x5AA1A0, 0x563856, 0xD074AD, 0x4F0BBA, 0xC94741, 0xC5DEB7, 0x43924C,
+	0x7D6C62, 0xFB2099, 0xF7B96F, 0x71F594, 0xEE8A83, 0x68C678, 0x645F8E, 0xE21375,
+	0x15723B, 0x933EC0, 0x9FA736, 0x19EBCD, 0x8694DA, 0x00D821, 0x0C41D7, 0x8A0D2C,
+	0xB4F302, 0x32BFF9, 0x3E260F, 0xB86AF4, 0x2715E3, 0xA15918, 0xADC0EE, 0x2B8C15,
+	0xD03CB2, 0x567049, 0x5AE9BF, 0xDCA544, 0x43DA53, 0xC596A8, 0xC90F5E, 0x4F43A5,
+	0x71BD8B, 0xF7F170, 0xFB6886, 0x7D247D, 0xE25B6A, 0x641791, 0x688E67, 0xEEC29C,
+	0x3347A4, 0xB50B5F, 0xB992A9, 0x3FDE52, 0xA0A145, 0x26EDBE, 0x2A7448, 0xAC38B3,
+	0x92C69D, 0x148A66, 0x181390, 0x9E5F6B, 0x01207C, 0x876C87, 0x8BF571, 0x0DB98A,
+	0xF6092D, 0x7045D6, 0x7CDC20, 0xFA90DB, 0x65EFCC, 0xE3A337, 0xEF3AC1, 0x69763A,
+	0x578814, 0xD1C4EF, 0xDD5D19, 0x5B11E2, 0xC46EF5, 0x42220E, 0x4EBBF8, 0xC8F703,
+	0x3F964D, 0xB9DAB6, 0xB54340, 0x330FBB, 0xAC70AC, 0x2A3C57, 0x26A5A1, 0xA0E95A,
+	0x9E1774, 0x185B8F, 0x14C279, 0x928E82, 0x0DF195, 0x8BBD6E, 0x872498, 0x016863,
+	0xFAD8C4, 0x7C943F, 0x700DC9, 0xF64132, 0x693E25, 0xEF72DE, 0xE3EB28, 0x65A7D3,
+	0x5B59FD, 0xDD1506, 0xD18CF0, 0x57C00B, 0xC8BF1C, 0x4EF3E7, 0x426A11, 0xC426EA,
+	0x2AE476, 0xACA88D, 0xA0317B, 0x267D80, 0xB90297, 0x3F4E6C, 0x33D79A, 0xB59B61,
+	0x8B654F, 0x0D29B4, 0x01B042, 0x87FCB9, 0x1883AE, 0x9ECF55, 0x9256A3, 0x141A58,
+	0xEFAAFF, 0x69E604, 0x657FF2, 0xE33309, 0x7C4C1E, 0xFA00E5, 0xF69913, 0x70D5E8,
+	0x4E2BC6, 0xC8673D, 0xC4FECB, 0x42B230, 0xDDCD27, 0x5B81DC, 0x57182A, 0xD154D1,
+	0x26359F, 0xA07964, 0xACE092, 0x2AAC69, 0xB5D37E, 0x339F85, 0x3F0673, 0xB94A88,
+	0x87B4A6, 0x01F85D, 0x0D61AB, 0x8B2D50, 0x145247, 0x921EBC, 0x9E874A, 0x18CBB1,
+	0xE37B16, 0x6537ED, 0x69AE1B, 0xEFE2E0, 0x709DF7, 0xF6D10C, 0xFA48FA, 0x7C0401,
+	0x42FA2F, 0xC4B6D4, 0xC82F22, 0x4E63D9, 0xD11CCE, 0x575035, 0x5BC9C3, 0xDD8538,
+};
+
+static size_t radix64_span_scalar(const char * const data, const size_t length) {
+	size_t index = 0;
+	while (index < length && radix64_table[(uint8_t)data[index]]) {
+		index++;
+	}
+	return index;
+}
+
+#if defined(__SSE2__)
+/* 
+ * Signed byte compares: anything >= 0x80 is negative and fall out of every
+ * range, so it is rejected as it should. '/' and the digits are contiguous.
+ */
+static size_t radix64_span_sse2(const char * const data, const size_t length) {
+	const __m128i upper_lo = _mm_set1_epi8('A' - 1), upper_hi = _mm_set1_epi8('Z' + 1);
+	const __m128i lower_lo = _mm_set1_epi8('a' - 1), lower_hi = _mm_set1_epi8('z' + 1);
+	const __m128i digit_lo = _mm_set1_epi8('/' - 1), digit_hi = _mm_set1_epi8('9' + 1);
+	const __m128i plus = _mm_set1_epi8('+'), equal = _mm_set1_epi8('='), newline = _mm_set1_epi8('\n');
+	size_t index = 0;
+	
+	for (; index + 16 <= length; index += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(data + index));
+		__m128i valid = _mm_and_si128(_mm_cmpgt_epi8(x, upper_lo), _mm_cmplt_epi8(x, upper_hi));
+		valid = _mm_or_si128(valid, _mm_and_si128(_mm_cmpgt_epi8(x, lower_lo), _mm_cmplt_epi8(x, lower_hi)));
+		valid = _mm_or_si128(valid, _mm_and_si128(_mm_cmpgt_epi8(x, digit_lo), _mm_cmplt_epi8(x, digit_hi)));
+		valid = _mm_or_si128(valid, _mm_cmpeq_epi8(x, plus));
+		valid = _mm_or_si128(valid, _mm_cmpeq_epi8(x, equal));
+		valid = _mm_or_si128(valid, _mm_cmpeq_epi8(x, newline));
+		
+		unsigned int mask = _mm_movemask_epi8(valid);
+		if (mask != 0xFFFF) {
+			return index + __builtin_ctz(~mask);
+		}
+	}
+	
+	return index + radix64_span_scalar(data + index, length - index);
+}
+#endif
+
+#if defined(ARMOR_HAVE_AVX2)
+__attribute__((target("avx2")))
+static size_t radix64_span_avx2(const char * const data, const size_t length) {
+	const __m256i upper_lo = _mm256_set1_epi8('A' - 1), upper_hi = _mm256_set1_epi8('Z' + 1);
+	const __m256i lower_lo = _mm256_set1_epi8('a' - 1), lower_hi = _mm256_set1_epi8('z' + 1);
+	const __m256i digit_lo = _mm256_set1_epi8('/' - 1), digit_hi = _mm256_set1_epi8('9' + 1);
+	const __m256i plus = _mm256_set1_epi8('+'), equal = _mm256_set1_epi8('='), newline = _mm256_set1_epi8('\n');
+	size_t index = 0;
+	
+	for (; index + 32 <= length; index += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(data + index));
+		__m256i valid = _mm256_and_si256(_mm256_cmpgt_epi8(x, upper_lo), _mm256_cmpgt_epi8(upper_hi, x));
+		valid = _mm256_or_si256(valid, _mm256_and_si256(_mm256_cmpgt_epi8(x, lower_lo), _mm256_cmpgt_epi8(lower_hi, x)));
+		valid = _mm256_or_si256(valid, _mm256_and_si256(_mm256_cmpgt_epi8(x, digit_lo), _mm256_cmpgt_epi8(digit_hi, x)));
+		valid = _mm256_or_si256(valid, _mm256_cmpeq_epi8(x, plus));
+		valid = _mm256_or_si256(valid, _mm256_cmpeq_epi8(x, equal));
+		valid = _mm256_or_si256(valid, _mm256_cmpeq_epi8(x, newline));
+		
+		unsigned int mask = _mm256_movemask_epi8(valid);
+		if (mask != 0xFFFFFFFFu) {
+			return index + __builtin_ctz(~mask);
+		}
+	}
+	
+	return index + radix64_span_scalar(data + index, length - index);
+}
+#endif
+
+size_t armor_radix64_span(const char * const data, const size_t length) {
+#if defined(ARMOR_HAVE_AVX2)
+	static int has_avx2 = -1;
+	if (has_avx2 == -1) {
+		has_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0; //same answer on every thread, the race is harmless
+	}
+	if (has_avx2) {
+		return radix64_span_avx2(data, length);
+	}
+#endif
+#if defined(__SSE2__)
+	return radix64_span_sse2(data, length);
+#else
+	return radix64_span_scalar(data, length);
+#endif
+}
+
+ssize_t armor_find_marker(const char * const data, const size_t length, const char * const marker, const size_t marker_length, size_t * const matched) {
+	/* finish the marker started in the previous chunk */
+	while (*matched > 0) {
+		size_t need = marker_length - *matched;
+		size_t n = need < length ? need : length;
+		
+		if (memcmp(data, marker + *matched, n) == 0) {
+			*matched += n;
+			if (*matched == marker_length) {
+				*matched = 0;
+				return n;
+			}
+			return -1; //chunk ended again in the middle of the marker
+		}
+		
+		/* mismatch, but a shorter tail of what matched may still start a marker ("------BEGIN") */
+		size_t k = *matched - 1;
+		while (k > 0 && memcmp(marker + *matched - k, marker, k) != 0) {
+			k--;
+		}
+		*matched = k;
+		if (k == 0) {
+			break;
+		}
+	}
+	
+	const char *found = memmem(data, length, marker, marker_length);
+	if (found != NULL) {
+		return (found - data) + marker_length;
+	}
+	
+	/* keep track of a marker prefix at the end of the chunk */
+	size_t k = marker_length - 1 < length ? marker_length - 1 : length;
+	for (; k > 0; k--) {
+		if (data[length - k] == marker[0] && memcmp(data + length - k, marker, k) == 0) {
+			break;
+		}
+	}
+	*matched = k;
+	return -1;
+}
+
+uint32_t armor_crc24(uint32_t crc, const uint8_t * const data, const size_t length) {
+	for (size_t i = 0; i < length; i++) {
+		crc = (crc << 8) ^ crc24_table[((crc >> 16) ^ data[i]) & 0xFF];
+	}
+	return crc & 0xFFFFFF;
+}
+
+void armor_decoder_init(struct armor_decoder * const decoder) {
+	memset(decoder, 0, sizeof(struct armor_decoder));
+	decoder->state = ARMOR_DECODE_DATA;
+	decoder->crc = ARMOR_CRC24_INIT;
+	decoder->line_start = true;
+}
+
+ssize_t armor_decode(struct armor_decoder * const decoder, const char * const data, const size_t length, uint8_t * const output) {
+	const uint8_t * const input = (const uint8_t *)data;
+	size_t index = 0;
+	size_t written = 0;
+	
+	while (index < length) {
+		uint8_t c = input[index];
+		uint8_t value = radix64_value[c];
+		
+		switch (decoder->state) {
+			case ARMOR_DECODE_DATA:
+				/* fast path: whole groups of 4 digits, a line is 16 of them */
+				if (decoder->sextets == 0) {
+					while (index + 4 <= length) {
+						uint32_t a = radix64_value[input[index]], b = radix64_value[input[index + 1]];
+						uint32_t d = radix64_value[input[index + 2]], e = radix64_value[input[index + 3]];
+						if ((a | b | d | e) & 0x80) {
+							break;
+						}
+						uint32_t group = a << 18 | b << 12 | d << 6 | e;
+						output[written] = group >> 16;
+						output[written + 1] = group >> 8;
+						output[written + 2] = group;
+						written += 3;
+						index += 4;
+						decoder->line_start = false;
+					}
+					if (index == length) {
+						break;
+					}
+					c = input[index];
+					value = radix64_value[c];
+				}
+				
+				index++;
+				if (value != 0xFF) {
+					decoder->group = decoder->group << 6 | value;
+					if (++decoder->sextets == 4) {
+						output[written] = decoder->group >> 16;
+						output[written + 1] = decoder->group >> 8;
+						output[written + 2] = decoder->group;
+						written += 3;
+						decoder->group = 0;
+						decoder->sextets = 0;
+					}
+					decoder->line_start = false;
+				}else if (c == '\n') {
+					decoder->line_start = true;
+				}else if (c == '=' && decoder->sextets == 0 && decoder->line_start) {
+					decoder->state = ARMOR_DECODE_CHECKSUM;
+					decoder->line_start = false;
+				}else if (c == '=' && decoder->sextets >= 2) {
+					/* padding: 2 digits carry 1 byte, 3 digits carry 2 */
+					uint32_t group = decoder->group << (6 * (4 - decoder->sextets));
+					output[written++] = group >> 16;
+					if (decoder->sextets == 3) {
+						output[written++] = group >> 8;
+					}
+					decoder->state = decoder->sextets == 2 ? ARMOR_DECODE_PADDING : ARMOR_DECODE_END;
+					decoder->group = 0;
+					decoder->sextets = 0;
+					decoder->line_start = false;
+				}else{
+					return -1;
+				}
+				break;
+			case ARMOR_DECODE_PADDING:
+				if (c != '=') {
+					return -1;
+				}
+				index++;
+				decoder->state = ARMOR_DECODE_END;
+				break;
+			case ARMOR_DECODE_END: //the data is over, only the checksum may follow
+				index++;
+				if (c == '\n') {
+					decoder->line_start = true;
+				}else if (c == '=' && decoder->line_start) {
+					decoder->state = ARMOR_DECODE_CHECKSUM;
+					decoder->line_start = false;
+				}else{
+					return -1;
+				}
+				break;
+			case ARMOR_DECODE_CHECKSUM:
+				if (value == 0xFF) {
+					return -1;
+				}
+				index++;
+				decoder->checksum = decoder->checksum << 6 | value;
+				if (++decoder->sextets == 4) {
+					decoder->sextets = 0;
+					decoder->has_checksum = true;
+					decoder->state = ARMOR_DECODE_DONE;
+				}
+				break;
+			case ARMOR_DECODE_DONE:
+				if (c != '\n') {
+					return -1;
+				}
+				index++;
+				break;
+		}
+	}
+	
+	decoder->crc = armor_crc24(decoder->crc, output, written);
+	return written;
+}
+
+int armor_decoder_finish(const struct armor_decoder * const decoder) {
+	switch (decoder->state) {
+		case ARMOR_DECODE_DATA:
+			return decoder->sextets == 0 ? 0 : -1; //a checksum is optional, a partial group is not
+		case ARMOR_DECODE_END:
+			return 0;
+		case ARMOR_DECODE_DONE:
+			return decoder->checksum == decoder->crc ? 0 : -1;
+		default:
+			return -1;
+	}
+}
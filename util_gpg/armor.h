@@ -0,0 +1,55 @@
+#ifndef ARMOR_H
+#define ARMOR_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* 
+ * Building blocks to scan ASCII armored (RFC 4880 radix-64) data, vectorized
+ * with SSE2/AVX2 when the CPU allow it and a scalar fallback otherwise.
+ */
+
+/* length of the leading run of radix-64 characters: [A-Za-z0-9+/=] and '\n' */
+size_t armor_radix64_span(const char * const data, const size_t length);
+
+/* 
+ * Look for marker in a stream split in chunks. matched holds how many bytes of
+ * the marker were at the very end of the previous chunk, start with 0.
+ * Return the offset right after the marker when it ends in this chunk,
+ * -1 otherwise (matched is then updated for the next chunk).
+ */
+ssize_t armor_find_marker(const char * const data, const size_t length, const char * const marker, const size_t marker_length, size_t * const matched);
+
+/* CRC-24 used by the armor checksum line, start from ARMOR_CRC24_INIT */
+#define ARMOR_CRC24_INIT 0xB704CEu
+uint32_t armor_crc24(uint32_t crc, const uint8_t * const data, const size_t length);
+
+/* 
+ * Incremental radix-64 decoder for the body of an armored block, newlines
+ * included, and the optional "=XXXX" checksum line that follows it. The
+ * CRC-24 of the decoded bytes is kept along the way.
+ */
+struct armor_decoder{
+	enum {ARMOR_DECODE_DATA, ARMOR_DECODE_PADDING, ARMOR_DECODE_END, ARMOR_DECODE_CHECKSUM, ARMOR_DECODE_DONE} state;
+	uint32_t group; //digits of the group in progress
+	unsigned int sextets; //how many
+	bool line_start;
+	uint32_t crc;
+	uint32_t checksum;
+	bool has_checksum;
+};
+
+void armor_decoder_init(struct armor_decoder * const decoder);
+
+/* output room needed to decode length characters */
+#define ARMOR_DECODED_SIZE(length) ((length) / 4 * 3 + 3)
+
+/* decode a chunk into output, return the bytes written or -1 on invalid data */
+ssize_t armor_decode(struct armor_decoder * const decoder, const char * const data, const size_t length, uint8_t * const output);
+
+/* 0 when the data is complete and the checksum, if any, matches */
+int armor_decoder_finish(const struct armor_decoder * const decoder);
+
+#endif
@@ -0,0 +1,383 @@
+#include "util_gpg/gpg_keybox.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <ctype.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* keybox format, see kbx/keybox-blob.c in GnuPG */
+#define BLOB_HEADER 1
+#define BLOB_OPENPGP 2
+#define BLOB_OPENPGP_V2 2 //32 bytes fingerprint field and a keygrip per key
+#define BLOB_MIN_LENGTH 20
+#define KEYINFO_V2_LENGTH 56
+#define KEYFLAG_FPR32 0x80
+#define UIDINFO_LENGTH 12
+#define KEYGRIP_LENGTH 20
+
+static uint32_t get32(const uint8_t * const p) {
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint16_t get16(const uint8_t * const p) {
+	return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static void to_hex(char * const out, const uint8_t * const data, const size_t length) {
+	static const char digits[] = "0123456789ABCDEF";
+	for (size_t i = 0; i < length; i++) {
+		out[2 * i] = digits[data[i] >> 4];
+		out[2 * i + 1] = digits[data[i] & 0xF];
+	}
+	out[2 * length] = '\0';
+}
+
+void gpgsession_keyinfo_free(struct gpgsession_keyinfo *info) {
+	if (info == NULL) {
+		return;
+	}
+	for (size_t i = 0; i < info->number_of_uids; i++) {
+		free(info->uids[i]);
+	}
+	free(info->uids);
+	free(info->keyids);
+	free(info->keygrips);
+	free(info);
+}
+
+static struct gpgsession_keyinfo *keyinfo_new(const size_t number_of_subkeys, const size_t number_of_uids) {
+	struct gpgsession_keyinfo *info = calloc(1, sizeof(struct gpgsession_keyinfo));
+	if (info == NULL) {
+		return NULL;
+	}
+	info->keyids = calloc(number_of_subkeys + 1, sizeof(*info->keyids));
+	info->keygrips = calloc(number_of_subkeys + 1, sizeof(*info->keygrips));
+	info->uids = calloc(number_of_uids + 1, sizeof(char *));
+	if (info->keyids == NULL || info->keygrips == NULL || info->uids == NULL) {
+		gpgsession_keyinfo_free(info);
+		return NULL;
+	}
+	return info;
+}
+
+struct gpgsession_keyinfo *gpgsession_keyinfo_from_key(const gpgme_key_t key) {
+	size_t number_of_subkeys = 0, number_of_uids = 0;
+	
+	for (gpgme_subkey_t subkey = key->subkeys; subkey != NULL; subkey = subkey->next) {
+		number_of_subkeys++;
+	}
+	for (gpgme_user_id_t uid = key->uids; uid != NULL; uid = uid->next) {
+		number_of_uids++;
+	}
+	
+	struct gpgsession_keyinfo *info = keyinfo_new(number_of_subkeys, number_of_uids);
+	if (info == NULL) {
+		perror("failed to allocate key info, out of RAM?");
+		return NULL;
+	}
+	
+	snprintf(info->fpr, sizeof(info->fpr), "%s", key->fpr ? key->fpr : "");
+	for (gpgme_subkey_t subkey = key->subkeys; subkey != NULL; subkey = subkey->next, info->number_of_subkeys++) {
+		snprintf(info->keyids[info->number_of_subkeys], sizeof(info->keyids[0]), "%s", subkey->keyid ? subkey->keyid : "");
+		snprintf(info->keygrips[info->number_of_subkeys], sizeof(info->keygrips[0]), "%s", subkey->keygrip ? subkey->keygrip : "");
+	}
+	for (gpgme_user_id_t uid = key->uids; uid != NULL; uid = uid->next) {
+		if (uid->uid == NULL) {
+			continue;
+		}
+		if ((info->uids[info->number_of_uids] = strdup(uid->uid)) == NULL) {
+			perror("failed to allocate key info, out of RAM?");
+			gpgsession_keyinfo_free(info);
+			return NULL;
+		}
+		info->number_of_uids++;
+	}
+	
+	return info;
+}
+
+bool gpgsession_keyinfo_equal(const struct gpgsession_keyinfo * const a, const struct gpgsession_keyinfo * const b) {
+	if (strcmp(a->fpr, b->fpr) != 0 || a->number_of_subkeys != b->number_of_subkeys || a->number_of_uids != b->number_of_uids) {
+		return false;
+	}
+	for (size_t i = 0; i < a->number_of_subkeys; i++) {
+		if (strcmp(a->keyids[i], b->keyids[i]) != 0 || strcmp(a->keygrips[i], b->keygrips[i]) != 0) {
+			return false;
+		}
+	}
+	for (size_t i = 0; i < a->number_of_uids; i++) {
+		if (strcmp(a->uids[i], b->uids[i]) != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int gpgsession_home_dir(const char * const home, char * const dir, const size_t size) {
+	int written;
+	
+	if (home != NULL) {
+		written = snprintf(dir, size, "%s", home);
+	}else if (getenv("GNUPGHOME") != NULL) {
+		written = snprintf(dir, size, "%s", getenv("GNUPGHOME"));
+	}else if (getenv("HOME") != NULL) {
+		written = snprintf(dir, size, "%s/.gnupg", getenv("HOME"));
+	}else{
+		return -1;
+	}
+	return written < 0 || (size_t)written >= size ? -1 : 0;
+}
+
+/* path of a file of the GnuPG home, -1 with errno ENAMETOOLONG when it does not fit */
+static int home_path(char * const path, const size_t size, const char * const home, const char * const name) {
+	int written = snprintf(path, size, "%s/%s", home, name);
+	if (written < 0 || (size_t)written >= size) {
+		errno = ENAMETOOLONG;
+		fprintf(stderr, "GnuPG home path too long: %s\n", home);
+		return -1;
+	}
+	return 0;
+}
+
+/* keygrips with a secret part, sorted for bsearch */
+struct keygrips{
+	char (*grips)[41];
+	size_t length;
+	size_t size;
+};
+
+static int compare_grips(const void *a, const void *b) {
+	return memcmp(a, b, 40);
+}
+
+static int scan_private_keys(const char * const home, struct keygrips * const secret) {
+	char path[4096];
+	if (home_path(path, sizeof(path), home, "private-keys-v1.d")) {
+		return -1;
+	}
+	
+	DIR *dir = opendir(path);
+	if (dir == NULL) {
+		return -1;
+	}
+	
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		/* <40 hex digits keygrip>.key */
+		if (strlen(entry->d_name) != 44 || strcmp(entry->d_name + 40, ".key") != 0) {
+			continue;
+		}
+		if (secret->length == secret->size) {
+			size_t size = secret->size ? secret->size * 2 : 64;
+			char (*tmp)[41] = realloc(secret->grips, size * sizeof(*secret->grips));
+			if (tmp == NULL) {
+				perror("failed to list private keys, out of RAM?");
+				closedir(dir);
+				return -1;
+			}
+			secret->grips = tmp;
+			secret->size = size;
+		}
+		for (size_t i = 0; i < 40; i++) {
+			secret->grips[secret->length][i] = toupper((unsigned char)entry->d_name[i]);
+		}
+		secret->grips[secret->length++][40] = '\0';
+	}
+	closedir(dir);
+	
+	qsort(secret->grips, secret->length, sizeof(*secret->grips), compare_grips);
+	return 0;
+}
+
+/* keyboxd (GnuPG 2.4) keeps the keys elsewhere, pubring.kbx is then left behind */
+static bool uses_keyboxd(const char * const home) {
+	char path[4096];
+	char line[256];
+	bool found = false;
+	
+	if (home_path(path, sizeof(path), home, "common.conf")) {
+		return false; //the keybox can not be read either
+	}
+	FILE *conf = fopen(path, "r");
+	if (conf == NULL) {
+		return false;
+	}
+	while (!found && fgets(line, sizeof(line), conf) != NULL) {
+		found = strncmp(line, "use-keyboxd", 11) == 0;
+	}
+	fclose(conf);
+	return found;
+}
+
+/* every blob must be known before the first key is reported, or a fallback would list keys twice */
+static int check_blobs(const uint8_t * const data, const size_t size) {
+	if (size < BLOB_MIN_LENGTH || data[4] != BLOB_HEADER || memcmp(data + 8, "KBXf", 4) != 0) {
+		return -1;
+	}
+	
+	for (size_t offset = 0; offset < size; ) {
+		if (size - offset < 6) {
+			return -1;
+		}
+		uint32_t length = get32(data + offset);
+		if (length < 6 || length > size - offset) {
+			return -1;
+		}
+		if (data[offset + 4] == BLOB_OPENPGP && data[offset + 5] < BLOB_OPENPGP_V2) {
+			return -1; //no keygrips to match with the private keys
+		}
+		offset += length;
+	}
+	return 0;
+}
+
+/* 1 and info set for a secret key, 0 to skip the blob, -1 if it is corrupt */
+static int parse_blob(const uint8_t * const blob, const size_t length, const struct keygrips * const secret, struct gpgsession_keyinfo ** const info) {
+	*info = NULL;
+	if (blob[4] != BLOB_OPENPGP) {
+		return 0;
+	}
+	if (length < BLOB_MIN_LENGTH) {
+		return -1;
+	}
+	if (get16(blob + 6) & 2) {
+		return 0; //ephemeral, not really in the keyring
+	}
+	
+	size_t number_of_keys = get16(blob + 16);
+	size_t keyinfo_length = get16(blob + 18);
+	size_t pos = 20;
+	if (number_of_keys == 0 || keyinfo_length < KEYINFO_V2_LENGTH || number_of_keys * keyinfo_length > length - pos) {
+		return -1;
+	}
+	
+	bool is_secret = false;
+	for (size_t k = 0; k < number_of_keys && !is_secret; k++) {
+		char grip[41];
+		to_hex(grip, blob + pos + k * keyinfo_length + 36, KEYGRIP_LENGTH);
+		is_secret = bsearch(grip, secret->grips, secret->length, sizeof(*secret->grips), compare_grips) != NULL;
+	}
+	if (!is_secret) {
+		return 0;
+	}
+	
+	size_t keys = pos;
+	pos += number_of_keys * keyinfo_length;
+	if (length - pos < 2 || get16(blob + pos) > length - pos - 2) {
+		return -1;
+	}
+	pos += 2 + get16(blob + pos); //serial number, X.509 only
+	if (length - pos < 4) {
+		return -1;
+	}
+	size_t number_of_uids = get16(blob + pos);
+	size_t uidinfo_length = get16(blob + pos + 2);
+	pos += 4;
+	if (number_of_uids > 0 && (uidinfo_length < UIDINFO_LENGTH || number_of_uids * uidinfo_length > length - pos)) {
+		return -1;
+	}
+	
+	*info = keyinfo_new(number_of_keys, number_of_uids);
+	if (*info == NULL) {
+		perror("failed to allocate key info, out of RAM?");
+		return -1;
+	}
+	
+	for (size_t k = 0; k < number_of_keys; k++) {
+		const uint8_t * const key = blob + keys + k * keyinfo_length;
+		bool v5 = get16(key + 32) & KEYFLAG_FPR32;
+		
+		if (k == 0) {
+			to_hex((*info)->fpr, key, v5 ? 32 : 20);
+		}
+		to_hex((*info)->keyids[k], v5 ? key : key + 12, 8); //v4: low 64 bits, v5: high 64 bits
+		to_hex((*info)->keygrips[k], key + 36, KEYGRIP_LENGTH);
+	}
+	(*info)->number_of_subkeys = number_of_keys;
+	
+	for (size_t u = 0; u < number_of_uids; u++) {
+		const uint8_t * const uid = blob + pos + u * uidinfo_length;
+		uint32_t offset = get32(uid), uid_length = get32(uid + 4);
+		if (offset > length || uid_length > length - offset) {
+			gpgsession_keyinfo_free(*info);
+			*info = NULL;
+			return -1;
+		}
+		if (((*info)->uids[u] = strndup((const char *)blob + offset, uid_length)) == NULL) {
+			perror("failed to allocate key info, out of RAM?");
+			gpgsession_keyinfo_free(*info);
+			*info = NULL;
+			return -1;
+		}
+		(*info)->number_of_uids++;
+	}
+	
+	return 1;
+}
+
+int gpgsession_keybox_list_secret(const char * const home, gpgsession_keyinfo_cb cb, void * const opaque) {
+	char dir[4096];
+	char path[4096];
+	struct keygrips secret = { 0 };
+	int rc = -1;
+	int fd = -1;
+	uint8_t *data = MAP_FAILED;
+	size_t size = 0;
+	
+	if (gpgsession_home_dir(home, dir, sizeof(dir))) {
+		return -1;
+	}
+	
+	if (uses_keyboxd(dir) || scan_private_keys(dir, &secret)) {
+		goto end;
+	}
+	
+	if (home_path(path, sizeof(path), dir, "pubring.kbx")) {
+		goto end;
+	}
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1 || st.st_size == 0) {
+		goto end;
+	}
+	size = st.st_size;
+	
+	/* gpg replaces the file when it changes it, the mapping stays consistent */
+	data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		perror("failed to map the keybox");
+		goto end;
+	}
+	madvise(data, size, MADV_SEQUENTIAL);
+	
+	if (check_blobs(data, size)) {
+		goto end;
+	}
+	
+	rc = 0;
+	for (size_t offset = 0; offset < size; offset += get32(data + offset)) {
+		struct gpgsession_keyinfo *info;
+		int found = parse_blob(data + offset, get32(data + offset), &secret, &info);
+		if (found == -1) {
+			fprintf(stderr, "corrupt keybox blob at %zu, skipped\n", offset);
+		}else if (found == 1 && cb(opaque, info)) {
+			break;
+		}
+	}
+	
+	end:
+	if (data != MAP_FAILED) {
+		munmap(data, size);
+	}
+	if (fd != -1) {
+		close(fd);
+	}
+	free(secret.grips);
+	return rc;
+}
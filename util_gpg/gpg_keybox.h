@@ -0,0 +1,44 @@
+#ifndef GPG_KEYBOX_H
+#define GPG_KEYBOX_H
+
+#include <gpgme.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+/* 
+ * What a key list needs to know about a key: fingerprint, key IDs and
+ * keygrips of its subkeys (the primary key first) and user IDs. Filled
+ * from gpgme or read straight from the keybox file.
+ */
+struct gpgsession_keyinfo{
+	char fpr[65]; //upper case hex, 40 or 64 digits
+	char **uids; //the primary one first
+	size_t number_of_uids;
+	char (*keyids)[17];
+	char (*keygrips)[41]; //empty string if unknown
+	size_t number_of_subkeys;
+};
+
+/* copy what matters out of a gpgme key, NULL if out of RAM */
+struct gpgsession_keyinfo *gpgsession_keyinfo_from_key(const gpgme_key_t key);
+void gpgsession_keyinfo_free(struct gpgsession_keyinfo *info);
+
+/* true when both have the same fingerprint, subkeys and user IDs */
+bool gpgsession_keyinfo_equal(const struct gpgsession_keyinfo * const a, const struct gpgsession_keyinfo * const b);
+
+/* directory of a GnuPG home as gpg finds it: home, else $GNUPGHOME, else ~/.gnupg */
+int gpgsession_home_dir(const char * const home, char * const dir, const size_t size);
+
+/* called for every secret key, the info belongs to the callback */
+typedef int (*gpgsession_keyinfo_cb)(void * const opaque, struct gpgsession_keyinfo *info);
+
+/* 
+ * List the secret keys of a GnuPG home (NULL for the default one) without
+ * gpg: the keybox (pubring.kbx) is mapped and its keygrips matched with the
+ * files of private-keys-v1.d. Return -1 without calling cb when it can not
+ * be done (no keybox, keyboxd, blobs without keygrip from older GnuPG...),
+ * the caller should ask gpg then.
+ */
+int gpgsession_keybox_list_secret(const char * const home, gpgsession_keyinfo_cb cb, void * const opaque);
+
+#endif
@@ -0,0 +1,679 @@
+#include "util_gpg/gpg_keycache.h"
+#include "util_gpg/gpg_session.h"
+#include "util_gpg/gpg_keybox.h"
+
+#include <stdio.h>
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+
+/* empty slot of the tables */
+#define NO_KEY SIZE_MAX
+
+/* 
+ * Open addressing table hash -> key index, at most half full. Only the hash
+ * is stored: a hit is checked against the key itself, so nothing points into
+ * a key that may be replaced, and stale entries are harmless.
+ */
+struct index_entry{
+	uint64_t hash;
+	size_t key;
+};
+
+struct index_table{
+	struct index_entry *slots;
+	size_t number_of_slots;
+	size_t used;
+};
+
+/* key indexes of every user ID holding a trigram */
+struct trigram_entry{
+	uint32_t trigram; //0 for an empty slot, a trigram has no NUL
+	uint32_t length;
+	uint32_t size;
+	uint32_t *keys;
+};
+
+struct gpgsession_keycache{
+	struct gpgsession_keyinfo **keys; //NULL once removed, the index is not reused
+	gpgme_key_t *details; //full gpgme key, only once asked for
+	size_t number_of_keys;
+	size_t size;
+	
+	struct index_table by_fpr;
+	struct index_table by_keyid; //long and short ids of every subkey
+	struct index_table by_keygrip;
+	
+	struct trigram_entry *trigrams; //over the lower case user IDs
+	size_t number_of_trigrams;
+	size_t used_trigrams;
+	
+	size_t *sorted; //indexes of the keys sorted by fingerprint, for prefixes
+	size_t number_of_sorted;
+	bool sorted_stale; //rebuilt on the next prefix search
+};
+
+/* FNV-1a, length bytes */
+static uint64_t hash_string(const char *data, const size_t length) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= (uint8_t)data[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static int index_init(struct index_table * const table, const size_t number_of_slots) {
+	struct index_entry *slots = malloc(number_of_slots * sizeof(struct index_entry));
+	if (slots == NULL) {
+		perror("failed to grow key cache, out of RAM?");
+		return -1;
+	}
+	for (size_t i = 0; i < number_of_slots; i++) {
+		slots[i].key = NO_KEY;
+	}
+	
+	struct index_table old = *table;
+	table->slots = slots;
+	table->number_of_slots = number_of_slots;
+	table->used = 0;
+	
+	for (size_t i = 0; i < old.number_of_slots; i++) {
+		if (old.slots[i].key != NO_KEY) {
+			size_t slot = old.slots[i].hash & (number_of_slots - 1);
+			while (slots[slot].key != NO_KEY) {
+				slot = (slot + 1) & (number_of_slots - 1);
+			}
+			slots[slot] = old.slots[i];
+			table->used++;
+		}
+	}
+	free(old.slots);
+	return 0;
+}
+
+static void index_clear(struct index_table * const table) {
+	for (size_t i = 0; i < table->number_of_slots; i++) {
+		table->slots[i].key = NO_KEY;
+	}
+	table->used = 0;
+}
+
+static void index_add(struct index_table * const table, const uint64_t hash, const size_t key) {
+	size_t mask = table->number_of_slots - 1;
+	size_t slot = hash & mask;
+	
+	for (; table->slots[slot].key != NO_KEY; slot = (slot + 1) & mask) {
+		if (table->slots[slot].hash == hash && table->slots[slot].key == key) {
+			return; //already there, ie. the key was refreshed
+		}
+	}
+	table->slots[slot].hash = hash;
+	table->slots[slot].key = key;
+	
+	if (++table->used * 2 > table->number_of_slots) {
+		index_init(table, table->number_of_slots * 2); //still usable if this fails, only slower
+	}
+}
+
+/* first key with this hash accepted by match, NO_KEY otherwise */
+static size_t index_find(const struct gpgsession_keycache * const cache, const struct index_table * const table, const uint64_t hash,
+		bool (*match)(const struct gpgsession_keyinfo * const key, const char * const string), const char * const string) {
+	size_t mask = table->number_of_slots - 1;
+	
+	for (size_t slot = hash & mask; table->slots[slot].key != NO_KEY; slot = (slot + 1) & mask) {
+		const struct gpgsession_keyinfo * const key = cache->keys[table->slots[slot].key];
+		if (table->slots[slot].hash == hash && key != NULL && match(key, string)) {
+			return table->slots[slot].key;
+		}
+	}
+	return NO_KEY;
+}
+
+static bool match_fpr(const struct gpgsession_keyinfo * const key, const char * const fpr) {
+	return strcmp(key->fpr, fpr) == 0;
+}
+
+static bool match_keyid(const struct gpgsession_keyinfo * const key, const char * const keyid) {
+	size_t length = strlen(keyid);
+	for (size_t i = 0; i < key->number_of_subkeys; i++) {
+		size_t id_length = strlen(key->keyids[i]);
+		if (id_length >= length && strcmp(key->keyids[i] + id_length - length, keyid) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool match_keygrip(const struct gpgsession_keyinfo * const key, const char * const keygrip) {
+	for (size_t i = 0; i < key->number_of_subkeys; i++) {
+		if (strcmp(key->keygrips[i], keygrip) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static uint32_t trigram_of(const char * const s) {
+	return (uint32_t)(uint8_t)tolower((unsigned char)s[0]) << 16 | (uint32_t)(uint8_t)tolower((unsigned char)s[1]) << 8 | (uint8_t)tolower((unsigned char)s[2]);
+}
+
+static struct trigram_entry *trigram_slot(const struct gpgsession_keycache * const cache, const uint32_t trigram) {
+	size_t mask = cache->number_of_trigrams - 1;
+	size_t slot = (trigram * 2654435761u) & mask;
+	
+	while (cache->trigrams[slot].trigram != 0 && cache->trigrams[slot].trigram != trigram) {
+		slot = (slot + 1) & mask;
+	}
+	return &cache->trigrams[slot];
+}
+
+static int trigrams_grow(struct gpgsession_keycache * const cache, const size_t number_of_trigrams) {
+	struct trigram_entry *old = cache->trigrams;
+	size_t old_number = cache->number_of_trigrams;
+	
+	cache->trigrams = calloc(number_of_trigrams, sizeof(struct trigram_entry));
+	if (cache->trigrams == NULL) {
+		perror("failed to grow key cache, out of RAM?");
+		cache->trigrams = old;
+		return -1;
+	}
+	cache->number_of_trigrams = number_of_trigrams;
+	for (size_t i = 0; i < old_number; i++) {
+		if (old[i].trigram != 0) {
+			*trigram_slot(cache, old[i].trigram) = old[i];
+		}
+	}
+	free(old);
+	return 0;
+}
+
+static void trigram_add(struct gpgsession_keycache * const cache, const uint32_t trigram, const size_t key) {
+	struct trigram_entry *entry = trigram_slot(cache, trigram);
+	
+	if (entry->trigram == 0) {
+		if ((cache->used_trigrams + 1) * 2 > cache->number_of_trigrams) {
+			if (trigrams_grow(cache, cache->number_of_trigrams * 2)) {
+				return;
+			}
+			entry = trigram_slot(cache, trigram);
+		}
+		entry->trigram = trigram;
+		cache->used_trigrams++;
+	}
+	
+	if (entry->length > 0 && entry->keys[entry->length - 1] == key) {
+		return; //same user ID or another one of the same key
+	}
+	if (entry->length == entry->size) {
+		uint32_t size = entry->size ? entry->size * 2 : 4;
+		uint32_t *tmp = realloc(entry->keys, size * sizeof(uint32_t));
+		if (tmp == NULL) {
+			perror("failed to grow key cache, out of RAM?");
+			return;
+		}
+		entry->keys = tmp;
+		entry->size = size;
+	}
+	entry->keys[entry->length++] = key;
+}
+
+/* every table entry of key, old ones of a replaced key stay and are filtered on lookup */
+static void index_key(struct gpgsession_keycache * const cache, const size_t index) {
+	const struct gpgsession_keyinfo * const key = cache->keys[index];
+	
+	index_add(&cache->by_fpr, hash_string(key->fpr, strlen(key->fpr)), index);
+	for (size_t i = 0; i < key->number_of_subkeys; i++) {
+		size_t length = strlen(key->keyids[i]);
+		if (length > 0) {
+			index_add(&cache->by_keyid, hash_string(key->keyids[i], length), index);
+		}
+		if (length > 8) {
+			index_add(&cache->by_keyid, hash_string(key->keyids[i] + length - 8, 8), index);
+		}
+		if (key->keygrips[i][0] != '\0') {
+			index_add(&cache->by_keygrip, hash_string(key->keygrips[i], strlen(key->keygrips[i])), index);
+		}
+	}
+	for (size_t u = 0; u < key->number_of_uids; u++) {
+		const char * const uid = key->uids[u];
+		for (size_t i = 0; uid[i] && uid[i + 1] && uid[i + 2]; i++) {
+			trigram_add(cache, trigram_of(uid + i), index);
+		}
+	}
+	
+	cache->sorted_stale = true;
+}
+
+int gpgsession_keycache_new(struct gpgsession_keycache **cache) {
+	if (cache == NULL) {
+		fprintf(stderr, "key cache must be not null\n");
+		return -1;
+	}
+	
+	*cache = calloc(1, sizeof(struct gpgsession_keycache));
+	if (*cache == NULL) {
+		perror("failed to allocate key cache, out of RAM?");
+		return -1;
+	}
+	if (index_init(&(*cache)->by_fpr, 64) || index_init(&(*cache)->by_keyid, 64) || index_init(&(*cache)->by_keygrip, 64) ||
+		trigrams_grow(*cache, 256)) {
+		gpgsession_keycache_free(cache);
+		return -1;
+	}
+	
+	return 0;
+}
+
+static void clear(struct gpgsession_keycache * const cache) {
+	for (size_t i = 0; i < cache->number_of_keys; i++) {
+		gpgsession_keyinfo_free(cache->keys[i]);
+		if (cache->details[i] != NULL) {
+			gpgme_key_release(cache->details[i]);
+		}
+	}
+	cache->number_of_keys = 0;
+	cache->number_of_sorted = 0;
+	cache->sorted_stale = false;
+	
+	index_clear(&cache->by_fpr);
+	index_clear(&cache->by_keyid);
+	index_clear(&cache->by_keygrip);
+	for (size_t i = 0; i < cache->number_of_trigrams; i++) {
+		cache->trigrams[i].length = 0; //keep the lists allocated, a reload refills them
+	}
+}
+
+void gpgsession_keycache_free(struct gpgsession_keycache **cache) {
+	if (cache == NULL || *cache == NULL) {
+		return;
+	}
+	struct gpgsession_keycache * const c = *cache;
+	
+	clear(c);
+	free(c->keys);
+	free(c->details);
+	free(c->by_fpr.slots);
+	free(c->by_keyid.slots);
+	free(c->by_keygrip.slots);
+	for (size_t i = 0; i < c->number_of_trigrams; i++) {
+		free(c->trigrams[i].keys);
+	}
+	free(c->trigrams);
+	free(c->sorted);
+	free(c);
+	*cache = NULL;
+}
+
+/* take ownership of key: replace the cached one with the same fingerprint or append it, return its index or -1 */
+static ssize_t put(struct gpgsession_keycache * const cache, struct gpgsession_keyinfo * const key) {
+	size_t index = index_find(cache, &cache->by_fpr, hash_string(key->fpr, strlen(key->fpr)), match_fpr, key->fpr);
+	if (index != NO_KEY && gpgsession_keyinfo_equal(cache->keys[index], key)) {
+		gpgsession_keyinfo_free(key); //unchanged, the details still hold
+		return index;
+	}
+	if (index != NO_KEY) {
+		gpgsession_keyinfo_free(cache->keys[index]);
+		cache->keys[index] = key;
+		if (cache->details[index] != NULL) {
+			gpgme_key_release(cache->details[index]); //outdated
+			cache->details[index] = NULL;
+		}
+		index_key(cache, index); //new subkeys or user IDs
+		return index;
+	}
+	
+	if (cache->number_of_keys == cache->size) {
+		size_t size = cache->size ? cache->size * 2 : 64;
+		struct gpgsession_keyinfo **keys = realloc(cache->keys, size * sizeof(struct gpgsession_keyinfo *));
+		if (keys != NULL) {
+			cache->keys = keys;
+		}
+		gpgme_key_t *details = realloc(cache->details, size * sizeof(gpgme_key_t));
+		if (details != NULL) {
+			cache->details = details;
+		}
+		if (keys == NULL || details == NULL) {
+			perror("failed to grow key cache, out of RAM?");
+			gpgsession_keyinfo_free(key);
+			return -1;
+		}
+		cache->size = size;
+	}
+	
+	cache->keys[cache->number_of_keys] = key;
+	cache->details[cache->number_of_keys] = NULL;
+	index_key(cache, cache->number_of_keys);
+	return cache->number_of_keys++;
+}
+
+/* the table entries pointing to it stay and are filtered on lookup */
+static void remove_key(struct gpgsession_keycache * const cache, const size_t index) {
+	gpgsession_keyinfo_free(cache->keys[index]);
+	cache->keys[index] = NULL;
+	if (cache->details[index] != NULL) {
+		gpgme_key_release(cache->details[index]);
+		cache->details[index] = NULL;
+	}
+	cache->sorted_stale = true;
+}
+
+struct load_state{
+	struct gpgsession_keycache *cache;
+	gpgsession_keycache_cb loaded;
+	void *opaque;
+	bool *seen; //refresh: which of the keys cached before are still listed
+	size_t number_of_seen;
+};
+
+static int load_info(void * const opaque, struct gpgsession_keyinfo *info) {
+	struct load_state * const state = opaque;
+	size_t before = state->cache->number_of_keys;
+	
+	ssize_t index = put(state->cache, info);
+	if (index == -1) {
+		return 0;
+	}
+	if ((size_t)index < state->number_of_seen) {
+		state->seen[index] = true;
+	}
+	if (state->loaded != NULL && state->cache->number_of_keys > before) {
+		state->loaded(state->opaque, index);
+	}
+	return 0;
+}
+
+/* gpgme keys turned into the records the keybox reader gives */
+struct key_adapter{
+	gpgsession_keyinfo_cb cb;
+	void *opaque;
+};
+
+static int adapt_key(void * const opaque, gpgme_key_t key) {
+	const struct key_adapter * const adapter = opaque;
+	struct gpgsession_keyinfo *info = gpgsession_keyinfo_from_key(key);
+	gpgme_key_release(key);
+	
+	return info != NULL ? adapter->cb(adapter->opaque, info) : 0;
+}
+
+static int list(gpgme_ctx_t * const ctx, const char * const home, gpgsession_keyinfo_cb cb, void * const opaque) {
+	struct key_adapter adapter = { .cb = cb, .opaque = opaque };
+	
+	/* straight from the files when possible, it spawns no process */
+	if (gpgsession_keybox_list_secret(home, cb, opaque) == 0) {
+		return 0;
+	}
+	return gpgsession_list_secret_keys(ctx, adapt_key, &adapter) ? -1 : 0;
+}
+
+int gpgsession_keycache_load(struct gpgsession_keycache *cache, gpgme_ctx_t * const ctx, const char * const home, gpgsession_keycache_cb loaded, void * const opaque) {
+	struct load_state state = { .cache = cache, .loaded = loaded, .opaque = opaque };
+	
+	clear(cache);
+	return list(ctx, home, load_info, &state);
+}
+
+struct key_list{
+	struct gpgsession_keyinfo **keys;
+	size_t length;
+	size_t size;
+	bool failed;
+};
+
+static int collect(void * const opaque, struct gpgsession_keyinfo *info) {
+	struct key_list * const found = opaque;
+	
+	if (found->length == found->size) {
+		size_t size = found->size ? found->size * 2 : 64;
+		struct gpgsession_keyinfo **keys = realloc(found->keys, size * sizeof(struct gpgsession_keyinfo *));
+		if (keys == NULL) {
+			perror("failed to list secret keys, out of RAM?");
+			gpgsession_keyinfo_free(info);
+			found->failed = true;
+			return -1; //stop, a partial list must not be taken for the keyring
+		}
+		found->keys = keys;
+		found->size = size;
+	}
+	found->keys[found->length++] = info;
+	return 0;
+}
+
+int gpgsession_keycache_list(gpgme_ctx_t * const ctx, const char * const home, struct gpgsession_keyinfo *** const keys, size_t * const number_of_keys) {
+	struct key_list found = { 0 };
+	
+	if (list(ctx, home, collect, &found) || found.failed) {
+		gpgsession_keycache_free_list(found.keys, found.length);
+		return -1;
+	}
+	*keys = found.keys;
+	*number_of_keys = found.length;
+	return 0;
+}
+
+void gpgsession_keycache_free_list(struct gpgsession_keyinfo ** const keys, const size_t number_of_keys) {
+	if (keys == NULL) {
+		return;
+	}
+	for (size_t i = 0; i < number_of_keys; i++) {
+		gpgsession_keyinfo_free(keys[i]);
+	}
+	free(keys);
+}
+
+int gpgsession_keycache_refresh(struct gpgsession_keycache *cache, struct gpgsession_keyinfo ** const keys, const size_t number_of_keys, gpgsession_keycache_cb added, void * const opaque) {
+	struct load_state state = { .cache = cache, .loaded = added, .opaque = opaque, .number_of_seen = cache->number_of_keys };
+	
+	state.seen = calloc(state.number_of_seen + 1, sizeof(bool));
+	if (state.seen == NULL) {
+		perror("failed to refresh key cache, out of RAM?");
+		return -1;
+	}
+	for (size_t i = 0; i < number_of_keys; i++) {
+		if (keys[i] != NULL) {
+			load_info(&state, keys[i]);
+			keys[i] = NULL;
+		}
+	}
+	
+	for (size_t i = 0; i < state.number_of_seen; i++) {
+		if (!state.seen[i] && cache->keys[i] != NULL) {
+			remove_key(cache, i);
+		}
+	}
+	free(state.seen);
+	return 0;
+}
+
+size_t gpgsession_keycache_update(struct gpgsession_keycache *cache, struct gpgsession_keyinfo ** const keys, const size_t number_of_keys) {
+	size_t updated = 0;
+	
+	for (size_t i = 0; i < number_of_keys; i++) {
+		if (keys[i] != NULL) {
+			updated += (put(cache, keys[i]) != -1);
+			keys[i] = NULL;
+		}
+	}
+	
+	return updated;
+}
+
+gpgme_key_t gpgsession_keycache_details(const struct gpgsession_keycache *cache, const size_t index) {
+	if (index >= cache->number_of_keys || cache->keys[index] == NULL) {
+		return NULL;
+	}
+	return cache->details[index];
+}
+
+int gpgsession_keycache_set_details(struct gpgsession_keycache *cache, gpgme_key_t details) {
+	size_t index = details->fpr ? index_find(cache, &cache->by_fpr, hash_string(details->fpr, strlen(details->fpr)), match_fpr, details->fpr) : NO_KEY;
+	if (index == NO_KEY) {
+		gpgme_key_release(details);
+		return -1;
+	}
+	if (cache->details[index] != NULL) {
+		gpgme_key_release(cache->details[index]);
+	}
+	cache->details[index] = details;
+	return 0;
+}
+
+size_t gpgsession_keycache_size(const struct gpgsession_keycache *cache) {
+	return cache->number_of_keys;
+}
+
+const struct gpgsession_keyinfo *gpgsession_keycache_get(const struct gpgsession_keycache *cache, const size_t index) {
+	return index < cache->number_of_keys ? cache->keys[index] : NULL;
+}
+
+ssize_t gpgsession_keycache_find(const struct gpgsession_keycache *cache, const char * const fpr) {
+	size_t index = index_find(cache, &cache->by_fpr, hash_string(fpr, strlen(fpr)), match_fpr, fpr);
+	return index == NO_KEY ? -1 : (ssize_t)index;
+}
+
+ssize_t gpgsession_keycache_find_keyid(const struct gpgsession_keycache *cache, const char * const keyid) {
+	size_t index = index_find(cache, &cache->by_keyid, hash_string(keyid, strlen(keyid)), match_keyid, keyid);
+	return index == NO_KEY ? -1 : (ssize_t)index;
+}
+
+ssize_t gpgsession_keycache_find_keygrip(const struct gpgsession_keycache *cache, const char * const keygrip) {
+	size_t index = index_find(cache, &cache->by_keygrip, hash_string(keygrip, strlen(keygrip)), match_keygrip, keygrip);
+	return index == NO_KEY ? -1 : (ssize_t)index;
+}
+
+static struct gpgsession_keycache *sorting; //qsort has no user data
+
+static int compare_fpr(const void *a, const void *b) {
+	return strcmp(sorting->keys[*(const size_t *)a]->fpr, sorting->keys[*(const size_t *)b]->fpr);
+}
+
+static int sort_by_fpr(struct gpgsession_keycache * const cache) {
+	if (!cache->sorted_stale) {
+		return 0;
+	}
+	
+	size_t *sorted = realloc(cache->sorted, (cache->number_of_keys + 1) * sizeof(size_t));
+	if (sorted == NULL) {
+		perror("failed to sort key cache, out of RAM?");
+		return -1;
+	}
+	cache->sorted = sorted;
+	cache->number_of_sorted = 0;
+	for (size_t i = 0; i < cache->number_of_keys; i++) {
+		if (cache->keys[i] != NULL) {
+			sorted[cache->number_of_sorted++] = i;
+		}
+	}
+	sorting = cache;
+	qsort(sorted, cache->number_of_sorted, sizeof(size_t), compare_fpr);
+	cache->sorted_stale = false;
+	return 0;
+}
+
+/* add index to found unless already there, return the new count */
+static size_t found_add(size_t * const found, const size_t count, const size_t max, const size_t index) {
+	for (size_t i = 0; i < count && i < max; i++) {
+		if (found[i] == index) {
+			return count;
+		}
+	}
+	if (count < max) {
+		found[count] = index;
+	}
+	return count + 1;
+}
+
+static bool uid_contains(const struct gpgsession_keyinfo * const key, const char * const query) {
+	if (key == NULL) {
+		return false; //removed
+	}
+	for (size_t i = 0; i < key->number_of_uids; i++) {
+		if (strcasestr(key->uids[i], query) != NULL) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static size_t search_uids(struct gpgsession_keycache * const cache, const char * const query, size_t * const found, const size_t max) {
+	size_t length = strlen(query);
+	size_t count = 0;
+	
+	if (length < 3) {
+		for (size_t i = 0; i < cache->number_of_keys; i++) {
+			if (uid_contains(cache->keys[i], query)) {
+				count = found_add(found, count, max, i);
+			}
+		}
+		return count;
+	}
+	
+	/* the rarest trigram of the query gives the fewest candidates to check */
+	const struct trigram_entry *best = NULL;
+	for (size_t i = 0; i + 2 < length; i++) {
+		const struct trigram_entry *entry = trigram_slot(cache, trigram_of(query + i));
+		if (entry->trigram == 0) {
+			return 0;
+		}
+		if (best == NULL || entry->length < best->length) {
+			best = entry;
+		}
+	}
+	
+	for (uint32_t i = 0; i < best->length; i++) {
+		if (uid_contains(cache->keys[best->keys[i]], query)) {
+			count = found_add(found, count, max, best->keys[i]);
+		}
+	}
+	return count;
+}
+
+size_t gpgsession_keycache_search(struct gpgsession_keycache *cache, const char *query, size_t * const found, const size_t max) {
+	char hex[64];
+	size_t length = 0;
+	size_t count = 0;
+	ssize_t index;
+	
+	if (strncasecmp(query, "0x", 2) == 0) {
+		query += 2;
+	}
+	
+	/* fingerprints, ids and grips are upper case hex */
+	while (query[length] && length < sizeof(hex) - 1 && isxdigit((unsigned char)query[length])) {
+		hex[length] = toupper((unsigned char)query[length]);
+		length++;
+	}
+	hex[length] = '\0';
+	
+	if (length > 0 && query[length] == '\0') {
+		if (length == 40 && ((index = gpgsession_keycache_find(cache, hex)) != -1 || (index = gpgsession_keycache_find_keygrip(cache, hex)) != -1)) {
+			found[0] = index;
+			return 1;
+		}
+		if ((length == 16 || length == 8) && (index = gpgsession_keycache_find_keyid(cache, hex)) != -1) {
+			found[0] = index;
+			return 1;
+		}
+		if (length >= GPGSESSION_KEYCACHE_MIN_PREFIX && sort_by_fpr(cache) == 0) {
+			size_t low = 0, high = cache->number_of_sorted;
+			while (low < high) {
+				size_t middle = low + (high - low) / 2;
+				if (strncmp(cache->keys[cache->sorted[middle]]->fpr, hex, length) < 0) {
+					low = middle + 1;
+				}else{
+					high = middle;
+				}
+			}
+			for (; low < cache->number_of_sorted && strncmp(cache->keys[cache->sorted[low]]->fpr, hex, length) == 0; low++) {
+				count = found_add(found, count, max, cache->sorted[low]);
+			}
+			if (count > 0) {
+				return count;
+			}
+		}
+	}
+	
+	return search_uids(cache, query, found, max);
+}
@@ -0,0 +1,81 @@
+#ifndef GPG_KEYCACHE_H
+#define GPG_KEYCACHE_H
+
+#include "util_gpg/gpg_keybox.h"
+
+#include <gpgme.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* 
+ * In-memory catalog of the secret keys, enumerated from gpg once and then
+ * kept up to date one key at time (ie. from the fingerprints of an import).
+ * Keys are only appended, replaced in place or removed, and an index is never
+ * reused: it always refers to the same key, or to nothing once it is gone. Keys are indexed by fingerprint, key ID and
+ * keygrip, and by trigrams of their user IDs for substring searches.
+ * Not thread safe, owned by the network thread.
+ */
+
+struct gpgsession_keycache;
+
+int gpgsession_keycache_new(struct gpgsession_keycache **cache);
+void gpgsession_keycache_free(struct gpgsession_keycache **cache);
+
+/* called with the index of every key as soon as it is in the cache */
+typedef void (*gpgsession_keycache_cb)(void * const opaque, const size_t index);
+
+/* 
+ * Enumerate the whole secret keyring of home (NULL for the default one), what
+ * the cache held is dropped; loaded may be NULL. The keybox is read directly
+ * when possible, else gpg lists the keys in the fast keylist mode.
+ */
+int gpgsession_keycache_load(struct gpgsession_keycache *cache, gpgme_ctx_t * const ctx, const char * const home, gpgsession_keycache_cb loaded, void * const opaque);
+
+/* 
+ * Enumerate the secret keyring of home like gpgsession_keycache_load() but
+ * without a cache, so it can run on a gpg worker: the records are returned,
+ * to be freed with gpgsession_keycache_free_list() once handed to the cache.
+ */
+int gpgsession_keycache_list(gpgme_ctx_t * const ctx, const char * const home, struct gpgsession_keyinfo *** const keys, size_t * const number_of_keys);
+void gpgsession_keycache_free_list(struct gpgsession_keyinfo ** const keys, const size_t number_of_keys);
+
+/* 
+ * Bring the cache in line with a new listing of the whole keyring, ie. after
+ * another program changed it: changed keys are replaced in place, added is
+ * called for the new ones and the keys no longer listed are removed. The
+ * cache takes the records and sets their entries to NULL.
+ */
+int gpgsession_keycache_refresh(struct gpgsession_keycache *cache, struct gpgsession_keyinfo ** const keys, const size_t number_of_keys, gpgsession_keycache_cb added, void * const opaque);
+
+/* add or refresh these keys only, ie. listed by a gpg worker after an import; the cache takes them and sets their entries to NULL, return how many are in the cache now */
+size_t gpgsession_keycache_update(struct gpgsession_keycache *cache, struct gpgsession_keyinfo ** const keys, const size_t number_of_keys);
+
+/* one past the last index, removed keys included */
+size_t gpgsession_keycache_size(const struct gpgsession_keycache *cache);
+
+/* NULL when out of range or removed, it belongs to the cache and is only valid until the next change */
+const struct gpgsession_keyinfo *gpgsession_keycache_get(const struct gpgsession_keycache *cache, const size_t index);
+
+/* full gpgme key with signatures and validity, NULL until gpgsession_keycache_set_details() or once the key changed */
+gpgme_key_t gpgsession_keycache_details(const struct gpgsession_keycache *cache, const size_t index);
+/* keep the details fetched by a gpg worker (gpgworker_job_details()) for the key with the same fingerprint; the cache takes them, -1 if that key is gone */
+int gpgsession_keycache_set_details(struct gpgsession_keycache *cache, gpgme_key_t details);
+
+/* index of the key, -1 if not in the cache; hex in upper case as gpg gives it */
+ssize_t gpgsession_keycache_find(const struct gpgsession_keycache *cache, const char * const fpr);
+/* long (16) or short (8) id of the key or of one of its subkeys */
+ssize_t gpgsession_keycache_find_keyid(const struct gpgsession_keycache *cache, const char * const keyid);
+ssize_t gpgsession_keycache_find_keygrip(const struct gpgsession_keycache *cache, const char * const keygrip);
+
+/* shortest hex accepted as a fingerprint prefix */
+#define GPGSESSION_KEYCACHE_MIN_PREFIX 4
+
+/* 
+ * Resolve what a user typed: a fingerprint, keygrip or key ID, a fingerprint
+ * prefix, else a piece of a user ID (ie. the email), case insensitive. Up to
+ * max indexes are written in found, return how many keys match (may be more).
+ */
+size_t gpgsession_keycache_search(struct gpgsession_keycache *cache, const char *query, size_t * const found, const size_t max);
+
+#endif
@@ -0,0 +1,126 @@
+#include "util_gpg/gpg_pool.h"
+#include "util_gpg/gpg_session.h"
+
+#include <stdio.h>
+#include <pthread.h>
+
+struct gpgsession_pool{
+	pthread_mutex_t lock;
+	pthread_cond_t available;
+	
+	gpgme_ctx_t *contexts; //the contexts themselves, never moved so we can hand out pointers
+	size_t size;
+	
+	gpgme_ctx_t **free_contexts; //stack of the available ones
+	size_t number_of_free;
+	
+	char *home;
+};
+
+int gpgsession_pool_new(struct gpgsession_pool **pool, const size_t size, bool ephemeral) {
+	if (pool == NULL || size == 0) {
+		fprintf(stderr, "gpg context pool must be not null and not empty\n");
+		return -1;
+	}
+	
+	/* once for the whole pool instead of once per context */
+	if (gpgsession_init()) {
+		return -1;
+	}
+	
+	*pool = calloc(1, sizeof(struct gpgsession_pool));
+	if (*pool == NULL) {
+		perror("failed to allocate gpg context pool, out of RAM?");
+		return -1;
+	}
+	struct gpgsession_pool * const p = *pool;
+	
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->available, NULL);
+	
+	p->contexts = calloc(size, sizeof(gpgme_ctx_t));
+	p->free_contexts = calloc(size, sizeof(gpgme_ctx_t *));
+	if (p->contexts == NULL || p->free_contexts == NULL) {
+		perror("failed to allocate gpg context pool, out of RAM?");
+		goto fail;
+	}
+	
+	if (ephemeral && gpgsession_ephemeral_home(&p->home)) {
+		goto fail;
+	}
+	
+	for (; p->size < size; p->size++) {
+		if (gpgsession_new_in(&p->contexts[p->size], p->home)) {
+			fprintf(stderr, "failed to create gpg context %zu of %zu\n", p->size, size);
+			goto fail;
+		}
+		p->free_contexts[p->number_of_free++] = &p->contexts[p->size];
+	}
+	
+	return 0;
+	
+	fail:
+	gpgsession_pool_free(pool);
+	return -1;
+}
+
+void gpgsession_pool_free(struct gpgsession_pool **pool) {
+	if (pool == NULL || *pool == NULL) {
+		return;
+	}
+	struct gpgsession_pool * const p = *pool;
+	
+	if (p->number_of_free != p->size) {
+		fprintf(stderr, "releasing gpg context pool with %zu context still in use\n", p->size - p->number_of_free);
+	}
+	
+	for (size_t i = 0; i < p->size; i++) {
+		gpgme_release(p->contexts[i]);
+	}
+	free(p->contexts);
+	free(p->free_contexts);
+	free(p->home);
+	
+	pthread_cond_destroy(&p->available);
+	pthread_mutex_destroy(&p->lock);
+	free(p);
+	*pool = NULL;
+}
+
+gpgme_ctx_t *gpgsession_pool_acquire(struct gpgsession_pool *pool) {
+	pthread_mutex_lock(&pool->lock);
+	while (pool->number_of_free == 0) {
+		pthread_cond_wait(&pool->available, &pool->lock);
+	}
+	gpgme_ctx_t *ctx = pool->free_contexts[--pool->number_of_free];
+	pthread_mutex_unlock(&pool->lock);
+	
+	return ctx;
+}
+
+gpgme_ctx_t *gpgsession_pool_try_acquire(struct gpgsession_pool *pool) {
+	gpgme_ctx_t *ctx = NULL;
+	
+	pthread_mutex_lock(&pool->lock);
+	if (pool->number_of_free > 0) {
+		ctx = pool->free_contexts[--pool->number_of_free];
+	}
+	pthread_mutex_unlock(&pool->lock);
+	
+	return ctx;
+}
+
+void gpgsession_pool_release(struct gpgsession_pool *pool, gpgme_ctx_t *ctx) {
+	if (ctx == NULL) {
+		return;
+	}
+	
+	pthread_mutex_lock(&pool->lock);
+	pool->free_contexts[pool->number_of_free++] = ctx;
+	pthread_cond_signal(&pool->available);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+const char *gpgsession_pool_home(struct gpgsession_pool *pool) {
+	return pool->home;
+}
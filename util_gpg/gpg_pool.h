@@ -0,0 +1,28 @@
+#ifndef GPG_POOL_H
+#define GPG_POOL_H
+
+#include <gpgme.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+/* 
+ * Set of gpgme contexts created and checked up front, all on the same GnuPG
+ * home. A context is used by one thread at time: acquire it, use it, release it.
+ */
+
+struct gpgsession_pool;
+
+/* ephemeral: all the contexts share one fresh GnuPG home */
+int gpgsession_pool_new(struct gpgsession_pool **pool, const size_t size, bool ephemeral);
+void gpgsession_pool_free(struct gpgsession_pool **pool);
+
+/* wait for a free context */
+gpgme_ctx_t *gpgsession_pool_acquire(struct gpgsession_pool *pool);
+/* NULL if all contexts are in use */
+gpgme_ctx_t *gpgsession_pool_try_acquire(struct gpgsession_pool *pool);
+void gpgsession_pool_release(struct gpgsession_pool *pool, gpgme_ctx_t *ctx);
+
+/* GnuPG home of the pool, NULL for the default one */
+const char *gpgsession_pool_home(struct gpgsession_pool *pool);
+
+#endif
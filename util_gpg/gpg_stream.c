@@ -0,0 +1,373 @@
+#include "util_gpg/gpg_stream.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+struct gpgsession_stream{
+	pthread_mutex_t lock;
+	pthread_cond_t readable;
+	pthread_cond_t writable; //a gpg writing the stream waits here
+	unsigned int refs;
+	
+	/* ring buffer */
+	char *buffer;
+	size_t capacity;
+	size_t head;
+	size_t length;
+	size_t written; //since the creation, the consumer read written - length
+	
+	bool closed;
+	bool complete;
+	bool consumer_done;
+	bool producer_waiting; //a write was short, call wake once there is space again
+	bool consumer_waiting; //a read found nothing, call wake once there is data
+	unsigned int timeout_ms; //gpg waiting for data longer than that gives up, 0 for never
+	
+	void (*wake)(void *arg);
+	void *arg;
+};
+
+int gpgsession_stream_new(struct gpgsession_stream **stream, const size_t capacity, void (*wake)(void *arg), void *arg) {
+	if (stream == NULL || capacity == 0) {
+		fprintf(stderr, "stream must be not null and have some capacity\n");
+		return -1;
+	}
+	
+	*stream = calloc(1, sizeof(struct gpgsession_stream));
+	if (*stream == NULL) {
+		perror("failed to allocate stream, out of RAM?");
+		return -1;
+	}
+	(*stream)->buffer = malloc(capacity);
+	if ((*stream)->buffer == NULL) {
+		perror("failed to allocate stream, out of RAM?");
+		free(*stream);
+		*stream = NULL;
+		return -1;
+	}
+	
+	/* timed waits on the monotonic clock, a clock change must not stall or cut an import */
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_mutex_init(&(*stream)->lock, NULL);
+	pthread_cond_init(&(*stream)->readable, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&(*stream)->writable, NULL);
+	(*stream)->refs = 1;
+	(*stream)->capacity = capacity;
+	(*stream)->wake = wake;
+	(*stream)->arg = arg;
+	
+	return 0;
+}
+
+void gpgsession_stream_ref(struct gpgsession_stream *stream) {
+	pthread_mutex_lock(&stream->lock);
+	stream->refs++;
+	pthread_mutex_unlock(&stream->lock);
+}
+
+void gpgsession_stream_unref(struct gpgsession_stream *stream) {
+	if (stream == NULL) {
+		return;
+	}
+	
+	pthread_mutex_lock(&stream->lock);
+	unsigned int refs = --stream->refs;
+	pthread_mutex_unlock(&stream->lock);
+	
+	if (refs == 0) {
+		pthread_cond_destroy(&stream->readable);
+		pthread_cond_destroy(&stream->writable);
+		pthread_mutex_destroy(&stream->lock);
+		free(stream->buffer);
+		free(stream);
+	}
+}
+
+/* copy into the ring, the caller checked the space and holds the lock */
+static void stream_put(struct gpgsession_stream * const stream, const char * const data, const size_t length) {
+	size_t tail = (stream->head + stream->length) % stream->capacity;
+	size_t first = stream->capacity - tail < length ? stream->capacity - tail : length;
+	
+	memcpy(stream->buffer + tail, data, first);
+	memcpy(stream->buffer, data + first, length - first);
+	stream->length += length;
+	stream->written += length;
+}
+
+/* copy out of the ring and wake a blocked writer, the caller holds the lock */
+static size_t stream_get(struct gpgsession_stream * const stream, void * const buffer, const size_t size) {
+	size_t n = stream->length < size ? stream->length : size;
+	size_t first = stream->capacity - stream->head < n ? stream->capacity - stream->head : n;
+	
+	memcpy(buffer, stream->buffer + stream->head, first);
+	memcpy((char *)buffer + first, stream->buffer, n - first);
+	stream->head = (stream->head + n) % stream->capacity;
+	stream->length -= n;
+	if (n > 0) {
+		pthread_cond_signal(&stream->writable);
+	}
+	return n;
+}
+
+size_t gpgsession_stream_write(struct gpgsession_stream *stream, const void * const data, const size_t length) {
+	pthread_mutex_lock(&stream->lock);
+	
+	if (stream->consumer_done || stream->closed) {
+		pthread_mutex_unlock(&stream->lock);
+		return length; //nobody will read it
+	}
+	
+	size_t space = stream->capacity - stream->length;
+	size_t n = space < length ? space : length;
+	
+	stream_put(stream, data, n);
+	if (n < length) {
+		stream->producer_waiting = true;
+	}
+	if (n > 0) {
+		pthread_cond_signal(&stream->readable);
+	}
+	
+	pthread_mutex_unlock(&stream->lock);
+	return n;
+}
+
+size_t gpgsession_stream_room(struct gpgsession_stream *stream, const size_t wanted) {
+	pthread_mutex_lock(&stream->lock);
+	
+	size_t room = stream->capacity - stream->length;
+	if (stream->consumer_done || stream->closed) {
+		room = SIZE_MAX; //writes are discarded anyway
+	}else if (room < wanted) {
+		stream->producer_waiting = true;
+	}
+	
+	pthread_mutex_unlock(&stream->lock);
+	return room;
+}
+
+size_t gpgsession_stream_length(struct gpgsession_stream *stream) {
+	pthread_mutex_lock(&stream->lock);
+	size_t length = stream->length;
+	pthread_mutex_unlock(&stream->lock);
+	return length;
+}
+
+size_t gpgsession_stream_written(struct gpgsession_stream *stream) {
+	pthread_mutex_lock(&stream->lock);
+	size_t written = stream->written;
+	pthread_mutex_unlock(&stream->lock);
+	return written;
+}
+
+int gpgsession_stream_truncate(struct gpgsession_stream *stream, const size_t mark) {
+	int rc = 0;
+	
+	pthread_mutex_lock(&stream->lock);
+	if (mark > stream->written || stream->written - mark > stream->length) {
+		rc = -1; //already (partly) read
+	}else{
+		stream->length -= stream->written - mark;
+		stream->written = mark;
+	}
+	pthread_mutex_unlock(&stream->lock);
+	
+	return rc;
+}
+
+int gpgsession_stream_split(struct gpgsession_stream *stream, const size_t mark, struct gpgsession_stream **tail) {
+	if (gpgsession_stream_new(tail, stream->capacity, stream->wake, stream->arg)) {
+		return -1;
+	}
+	
+	pthread_mutex_lock(&stream->lock);
+	if (mark > stream->written || stream->written - mark > stream->length) {
+		pthread_mutex_unlock(&stream->lock);
+		gpgsession_stream_unref(*tail);
+		*tail = NULL;
+		return -1; //already (partly) read
+	}
+	
+	/* the tail is new, nobody else sees it yet */
+	(*tail)->timeout_ms = stream->timeout_ms;
+	size_t moved = stream->written - mark;
+	size_t start = (stream->head + stream->length - moved) % stream->capacity;
+	size_t first = stream->capacity - start < moved ? stream->capacity - start : moved;
+	stream_put(*tail, stream->buffer + start, first);
+	stream_put(*tail, stream->buffer, moved - first);
+	stream->length -= moved;
+	stream->written = mark;
+	pthread_mutex_unlock(&stream->lock);
+	
+	return 0;
+}
+
+void gpgsession_stream_set_timeout(struct gpgsession_stream *stream, const unsigned int ms) {
+	pthread_mutex_lock(&stream->lock);
+	stream->timeout_ms = ms;
+	pthread_mutex_unlock(&stream->lock);
+}
+
+void gpgsession_stream_close(struct gpgsession_stream *stream, const bool complete) {
+	bool notify = false;
+	
+	pthread_mutex_lock(&stream->lock);
+	
+	if (!stream->closed) {
+		stream->closed = true;
+		stream->complete = complete;
+		pthread_cond_signal(&stream->readable);
+		notify = stream->consumer_waiting; //the end is news too
+		stream->consumer_waiting = false;
+	}
+	
+	pthread_mutex_unlock(&stream->lock);
+	
+	if (notify && stream->wake != NULL) {
+		stream->wake(stream->arg);
+	}
+}
+
+static gpgme_ssize_t stream_read(void *handle, void *buffer, size_t size) {
+	struct gpgsession_stream * const stream = handle;
+	bool notify = false;
+	
+	pthread_mutex_lock(&stream->lock);
+	
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += stream->timeout_ms / 1000;
+	deadline.tv_nsec += (stream->timeout_ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+	
+	bool stalled = false;
+	while (stream->length == 0 && !stream->closed && !stalled) {
+		if (stream->timeout_ms == 0) {
+			pthread_cond_wait(&stream->readable, &stream->lock);
+		}else{
+			stalled = pthread_cond_timedwait(&stream->readable, &stream->lock, &deadline) == ETIMEDOUT;
+		}
+	}
+	
+	if (stream->length == 0) {
+		bool complete = stream->closed && stream->complete;
+		unsigned int timeout_ms = stream->timeout_ms;
+		pthread_mutex_unlock(&stream->lock);
+		if (stalled) {
+			fprintf(stderr, "nothing received for %u ms in the middle of a key block, giving up on it\n", timeout_ms);
+		}
+		if (!complete) {
+			errno = EIO; //make gpg give up on a broken or stalled block
+			return -1;
+		}
+		return 0; //EOF
+	}
+	
+	size_t n = stream_get(stream, buffer, size);
+	
+	/* wake the producer only when half empty, not for every read */
+	if (stream->producer_waiting && stream->length <= stream->capacity / 2) {
+		stream->producer_waiting = false;
+		notify = true;
+	}
+	
+	pthread_mutex_unlock(&stream->lock);
+	
+	if (notify && stream->wake != NULL) {
+		stream->wake(stream->arg);
+	}
+	return n;
+}
+
+static struct gpgme_data_cbs stream_cbs = {
+	.read = stream_read,
+};
+
+gpgme_error_t gpgsession_stream_data(struct gpgsession_stream *stream, gpgme_data_t *data) {
+	return gpgme_data_new_from_cbs(data, &stream_cbs, stream);
+}
+
+ssize_t gpgsession_stream_read(struct gpgsession_stream *stream, void * const buffer, const size_t length) {
+	pthread_mutex_lock(&stream->lock);
+	
+	if (stream->length == 0 && stream->closed) {
+		bool complete = stream->complete;
+		pthread_mutex_unlock(&stream->lock);
+		errno = complete ? 0 : EIO;
+		return -1;
+	}
+	
+	size_t n = stream_get(stream, buffer, length);
+	if (n == 0) {
+		stream->consumer_waiting = true;
+	}
+	
+	pthread_mutex_unlock(&stream->lock);
+	return n;
+}
+
+void gpgsession_stream_done(struct gpgsession_stream *stream) {
+	bool notify;
+	
+	pthread_mutex_lock(&stream->lock);
+	stream->consumer_done = true;
+	notify = stream->producer_waiting; //writes are discarded from now on, let the producer go on
+	stream->producer_waiting = false;
+	pthread_cond_broadcast(&stream->writable); //same for a gpg blocked on a full stream
+	pthread_mutex_unlock(&stream->lock);
+	
+	if (notify && stream->wake != NULL) {
+		stream->wake(stream->arg);
+	}
+}
+
+static gpgme_ssize_t stream_sink_write(void *handle, const void *buffer, size_t size) {
+	struct gpgsession_stream * const stream = handle;
+	bool notify = false;
+	
+	pthread_mutex_lock(&stream->lock);
+	
+	while (stream->length == stream->capacity && !stream->consumer_done) {
+		pthread_cond_wait(&stream->writable, &stream->lock);
+	}
+	
+	if (stream->consumer_done) {
+		pthread_mutex_unlock(&stream->lock);
+		errno = EPIPE; //nobody reads it anymore, make gpg stop
+		return -1;
+	}
+	
+	size_t space = stream->capacity - stream->length;
+	size_t n = space < size ? space : size;
+	stream_put(stream, buffer, n);
+	
+	if (stream->consumer_waiting) {
+		stream->consumer_waiting = false;
+		notify = true;
+	}
+	
+	pthread_mutex_unlock(&stream->lock);
+	
+	if (notify && stream->wake != NULL) {
+		stream->wake(stream->arg);
+	}
+	return n;
+}
+
+static struct gpgme_data_cbs sink_cbs = {
+	.write = stream_sink_write,
+};
+
+gpgme_error_t gpgsession_stream_sink(struct gpgsession_stream *stream, gpgme_data_t *data) {
+	return gpgme_data_new_from_cbs(data, &sink_cbs, stream);
+}
@@ -0,0 +1,53 @@
+#ifndef GPG_STREAM_H
+#define GPG_STREAM_H
+
+#include <gpgme.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* 
+ * Bounded byte pipe between the network thread, which never blocks, and a gpg
+ * worker, which sees it as a gpgme_data_t and blocks. Import: the network
+ * thread writes what it receives, gpg reads it. Export: gpg writes, the
+ * network thread reads and sends. Memory stays at capacity no matter how big
+ * the key is.
+ */
+
+struct gpgsession_stream;
+
+/* wake is called from the worker when the network thread can go on: a full stream has room, an empty one has data */
+int gpgsession_stream_new(struct gpgsession_stream **stream, const size_t capacity, void (*wake)(void *arg), void *arg);
+
+/* the stream is freed when both producer and consumer dropped it */
+void gpgsession_stream_ref(struct gpgsession_stream *stream);
+void gpgsession_stream_unref(struct gpgsession_stream *stream);
+
+/* producer: return how many bytes were taken, less than length when full */
+size_t gpgsession_stream_write(struct gpgsession_stream *stream, const void * const data, const size_t length);
+/* producer: free space, when less than wanted on_room is called once there is more */
+size_t gpgsession_stream_room(struct gpgsession_stream *stream, const size_t wanted);
+/* producer: bytes written and not read yet */
+size_t gpgsession_stream_length(struct gpgsession_stream *stream);
+/* producer: total bytes written so far, a mark for gpgsession_stream_truncate() */
+size_t gpgsession_stream_written(struct gpgsession_stream *stream);
+/* producer: forget what was written after the mark, -1 if the consumer already read some of it */
+int gpgsession_stream_truncate(struct gpgsession_stream *stream, const size_t mark);
+/* producer: move what was written after the mark to a new stream with the same capacity and wake, -1 if the consumer already read some of it */
+int gpgsession_stream_split(struct gpgsession_stream *stream, const size_t mark, struct gpgsession_stream **tail);
+/* producer: gpg reading gives up as if the stream was closed not complete once nothing was written for ms, 0 (the default) waits forever; split streams keep it */
+void gpgsession_stream_set_timeout(struct gpgsession_stream *stream, const unsigned int ms);
+/* producer: no more data */
+void gpgsession_stream_close(struct gpgsession_stream *stream, const bool complete);
+
+/* consumer: gpgme data object reading from the stream, fails with EIO if the stream was closed as not complete */
+gpgme_error_t gpgsession_stream_data(struct gpgsession_stream *stream, gpgme_data_t *data);
+/* consumer: return bytes read, 0 when empty (wake is called once there is more), -1 at the end with errno EIO if not complete */
+ssize_t gpgsession_stream_read(struct gpgsession_stream *stream, void * const buffer, const size_t length);
+/* consumer: stop reading, whatever the producer still write is discarded */
+void gpgsession_stream_done(struct gpgsession_stream *stream);
+
+/* producer: gpgme data object writing to the stream, blocks while it is full and fails with EPIPE once the consumer is done */
+gpgme_error_t gpgsession_stream_sink(struct gpgsession_stream *stream, gpgme_data_t *data);
+
+#endif
@@ -0,0 +1,163 @@
+#include "util_gpg/gpg_watch.h"
+#include "util_gpg/gpg_keybox.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#define KEYBOX_NAME "pubring.kbx"
+#define PRIVATE_KEYS_NAME "private-keys-v1.d"
+
+/* gpg writes a temporary file and renames it, or writes in place and closes */
+#define FILE_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE)
+
+struct gpgsession_watch{
+	int fd;
+	int home_wd;
+	int keys_wd; //-1 until private-keys-v1.d exists
+	char keys_path[4096];
+};
+
+static void watch_keys(struct gpgsession_watch * const w) {
+	w->keys_wd = inotify_add_watch(w->fd, w->keys_path, FILE_EVENTS | IN_ONLYDIR);
+	if (w->keys_wd == -1 && errno != ENOENT) {
+		perror("failed to watch private-keys-v1.d");
+	}
+}
+
+int gpgsession_watch_new(struct gpgsession_watch **watch, const char * const home) {
+	char dir[4096];
+	
+	if (gpgsession_home_dir(home, dir, sizeof(dir))) {
+		fprintf(stderr, "no GnuPG home to watch\n");
+		return -1;
+	}
+	
+	struct gpgsession_watch *w = calloc(1, sizeof(struct gpgsession_watch));
+	if (w == NULL) {
+		perror("failed to allocate keyring watch, out of RAM?");
+		return -1;
+	}
+	w->fd = -1;
+	w->keys_wd = -1;
+	int written = snprintf(w->keys_path, sizeof(w->keys_path), "%s/" PRIVATE_KEYS_NAME, dir);
+	if (written < 0 || (size_t)written >= sizeof(w->keys_path)) {
+		fprintf(stderr, "GnuPG home path too long to watch: %s\n", dir);
+		goto fail;
+	}
+	
+	w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (w->fd == -1) {
+		perror("inotify_init1()");
+		goto fail;
+	}
+	/* IN_CREATE for a private-keys-v1.d made after the start */
+	w->home_wd = inotify_add_watch(w->fd, dir, FILE_EVENTS | IN_CREATE | IN_ONLYDIR);
+	if (w->home_wd == -1) {
+		perror("failed to watch the GnuPG home");
+		goto fail;
+	}
+	watch_keys(w);
+	
+	*watch = w;
+	return 0;
+	
+	fail:
+	if (w->fd != -1) {
+		close(w->fd);
+	}
+	free(w);
+	return -1;
+}
+
+void gpgsession_watch_free(struct gpgsession_watch **watch) {
+	if (watch == NULL || *watch == NULL) {
+		return;
+	}
+	close((*watch)->fd);
+	free(*watch);
+	*watch = NULL;
+}
+
+int gpgsession_watch_fd(const struct gpgsession_watch *watch) {
+	return watch->fd;
+}
+
+static bool is_key_file(const char * const name) {
+	size_t length = strlen(name);
+	return length > 4 && strcmp(name + length - 4, ".key") == 0;
+}
+
+int gpgsession_watch_changed(struct gpgsession_watch *watch) {
+	_Alignas(struct inotify_event) char buffer[4096];
+	int changed = 0;
+	
+	for (;;) {
+		ssize_t length = read(watch->fd, buffer, sizeof(buffer));
+		if (length == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return changed;
+			}
+			perror("failed to read keyring events");
+			return -1;
+		}
+		
+		for (char *p = buffer; p < buffer + length; ) {
+			const struct inotify_event * const event = (const struct inotify_event *)p;
+			const char * const name = event->len ? event->name : "";
+			p += sizeof(struct inotify_event) + event->len;
+			
+			if (event->mask & IN_Q_OVERFLOW) {
+				changed = 1; //events were lost, assume the worst
+			}else if (event->wd == watch->home_wd) {
+				if (strcmp(name, KEYBOX_NAME) == 0) {
+					changed = 1;
+				}else if (strcmp(name, PRIVATE_KEYS_NAME) == 0 && (event->mask & (IN_CREATE | IN_MOVED_TO)) && watch->keys_wd == -1) {
+					watch_keys(watch);
+					changed = 1;
+				}
+			}else if (event->wd == watch->keys_wd) {
+				if (event->mask & IN_IGNORED) {
+					watch->keys_wd = -1; //the directory is gone
+					changed = 1;
+				}else if (is_key_file(name)) {
+					changed = 1;
+				}
+			}
+		}
+	}
+}
+
+void gpgsession_keyring_stamp(const char * const home, struct gpgsession_keyring_stamp * const stamp) {
+	char dir[4096];
+	char path[4096];
+	struct stat st;
+	
+	memset(stamp, 0, sizeof(struct gpgsession_keyring_stamp));
+	if (gpgsession_home_dir(home, dir, sizeof(dir))) {
+		return;
+	}
+	
+	int written = snprintf(path, sizeof(path), "%s/" KEYBOX_NAME, dir);
+	if (written >= 0 && (size_t)written < sizeof(path) && stat(path, &st) == 0) {
+		stamp->keybox_inode = st.st_ino;
+		stamp->keybox_size = st.st_size;
+		stamp->keybox_time = st.st_mtim;
+	}
+	written = snprintf(path, sizeof(path), "%s/" PRIVATE_KEYS_NAME, dir);
+	if (written >= 0 && (size_t)written < sizeof(path) && stat(path, &st) == 0) {
+		stamp->keys_time = st.st_mtim;
+	}
+}
+
+bool gpgsession_keyring_stamp_equal(const struct gpgsession_keyring_stamp * const a, const struct gpgsession_keyring_stamp * const b) {
+	return a->keybox_inode == b->keybox_inode && a->keybox_size == b->keybox_size &&
+		a->keybox_time.tv_sec == b->keybox_time.tv_sec && a->keybox_time.tv_nsec == b->keybox_time.tv_nsec &&
+		a->keys_time.tv_sec == b->keys_time.tv_sec && a->keys_time.tv_nsec == b->keys_time.tv_nsec;
+}
@@ -0,0 +1,43 @@
+#ifndef GPG_WATCH_H
+#define GPG_WATCH_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/types.h>
+
+/*
+ * Tell when the secret keyring of a GnuPG home changes on disk: inotify on
+ * the home (pubring.kbx) and on private-keys-v1.d. The fd goes in the event
+ * loop, nothing has to be listed again until it says so.
+ */
+
+struct gpgsession_watch;
+
+/* home NULL for the default one */
+int gpgsession_watch_new(struct gpgsession_watch **watch, const char * const home);
+void gpgsession_watch_free(struct gpgsession_watch **watch);
+
+/* non blocking, readable when something happened */
+int gpgsession_watch_fd(const struct gpgsession_watch *watch);
+
+/* drain the pending events, return 1 if the keyring changed, 0 if not, -1 on error */
+int gpgsession_watch_changed(struct gpgsession_watch *watch);
+
+/* 
+ * What the keyring files look like on disk: equal stamps taken before and
+ * after something mean it did not write them, ie. the changes reported
+ * while our own gpg import ran were its own. Zeroes for a missing file.
+ */
+struct gpgsession_keyring_stamp{
+	ino_t keybox_inode; //gpg writes a new pubring.kbx and renames it
+	off_t keybox_size;
+	struct timespec keybox_time;
+	struct timespec keys_time; //private-keys-v1.d, a key file was added, replaced or removed
+};
+
+/* home NULL for the default one, can be called from any thread */
+void gpgsession_keyring_stamp(const char * const home, struct gpgsession_keyring_stamp * const stamp);
+bool gpgsession_keyring_stamp_equal(const struct gpgsession_keyring_stamp * const a, const struct gpgsession_keyring_stamp * const b);
+
+#endif
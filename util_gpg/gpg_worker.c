@@ -0,0 +1,732 @@
+#include "util_gpg/gpg_worker.h"
+#include "util_gpg/gpg_session.h"
+#include "util_gpg/gpg_keycache.h"
+#include "util_gpg/armor.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+
+/* bytes of a key block buffered between the network and gpg, blocks up to half of it are checked before gpg sees them */
+#define STREAM_CAPACITY (64 * 1024)
+
+/* a client silent this long in the middle of a key block gpg already reads loses it, instead of holding the worker */
+#define IMPORT_STALL_MS 10000
+
+/* decoded bytes written to a stream at once */
+#define DECODE_CHUNK 12288
+
+/* max jobs in flight, must be a power of two */
+#define QUEUE_SIZE 1024
+
+#define CACHE_LINE 64
+
+/* 
+ * Bounded multi producer / multi consumer queue (D. Vyukov): every cell has a
+ * sequence number telling if it is free for the producer at position pos
+ * (sequence == pos) or ready for the consumer (sequence == pos + 1).
+ */
+struct job_cell{
+	atomic_size_t sequence;
+	struct gpgworker_job *job;
+};
+
+struct job_queue{
+	struct job_cell cells[QUEUE_SIZE];
+	char pad0[CACHE_LINE];
+	atomic_size_t enqueue_pos;
+	char pad1[CACHE_LINE];
+	atomic_size_t dequeue_pos;
+	char pad2[CACHE_LINE];
+};
+
+struct gpgworker_pool{
+	struct job_queue submitted;
+	struct job_queue completed;
+	
+	atomic_size_t in_flight; //submitted and not yet collected, never more than QUEUE_SIZE so the queues can not overflow
+	atomic_size_t imports; //the import jobs among them
+	atomic_bool stop;
+	unsigned int stall_ms; //see gpgworker_set_stall_timeout()
+	sem_t pending; //one post per submitted job, idle workers sleep here
+	int event_fd;
+	
+	struct gpgsession_pool *contexts;
+	
+	pthread_t *threads;
+	size_t number_of_threads;
+};
+
+static void queue_init(struct job_queue * const queue) {
+	for (size_t i = 0; i < QUEUE_SIZE; i++) {
+		atomic_init(&queue->cells[i].sequence, i);
+		queue->cells[i].job = NULL;
+	}
+	atomic_init(&queue->enqueue_pos, 0);
+	atomic_init(&queue->dequeue_pos, 0);
+}
+
+static bool queue_push(struct job_queue * const queue, struct gpgworker_job * const job) {
+	struct job_cell *cell;
+	size_t pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+	
+	for (;;) {
+		cell = &queue->cells[pos & (QUEUE_SIZE - 1)];
+		size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+		intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+		
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&queue->enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+				break;
+			}
+		}else if (diff < 0) {
+			return false; //full
+		}else{
+			pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+		}
+	}
+	
+	cell->job = job;
+	atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+	return true;
+}
+
+static struct gpgworker_job *queue_pop(struct job_queue * const queue) {
+	struct job_cell *cell;
+	size_t pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+	
+	for (;;) {
+		cell = &queue->cells[pos & (QUEUE_SIZE - 1)];
+		size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+		intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+		
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&queue->dequeue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+				break;
+			}
+		}else if (diff < 0) {
+			return NULL; //empty
+		}else{
+			pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+		}
+	}
+	
+	struct gpgworker_job *job = cell->job;
+	atomic_store_explicit(&cell->sequence, pos + QUEUE_SIZE, memory_order_release);
+	return job;
+}
+
+/* list the keys imported in the worker too, so the network thread only has to put them in its cache */
+static void list_imported(gpgme_ctx_t * const ctx, struct gpgworker_job * const job) {
+	if (job->imported == 0) {
+		return;
+	}
+	job->keys = calloc(job->number_of_imports, sizeof(struct gpgsession_keyinfo *));
+	if (job->keys == NULL) {
+		perror("failed to allocate imported keys, out of RAM?");
+		return;
+	}
+	
+	for (size_t i = 0; i < job->number_of_imports; i++) {
+		const struct gpgsession_import_status * const status = &job->imports[i];
+		if (status->result != 0 || status->fpr == NULL) {
+			continue;
+		}
+		if (i > 0 && job->imports[i - 1].fpr != NULL && strcmp(job->imports[i - 1].fpr, status->fpr) == 0) {
+			continue; //gpg gives a secret key twice, public and secret part
+		}
+		gpgme_key_t key = gpgsession_get_secret_key(ctx, status->fpr);
+		if (key == NULL) {
+			continue; //not a secret key, nothing to offer
+		}
+		job->keys[job->number_of_keys] = gpgsession_keyinfo_from_key(key);
+		gpgme_key_release(key);
+		job->number_of_keys += (job->keys[job->number_of_keys] != NULL);
+	}
+}
+
+static void run_job(gpgme_ctx_t * const ctx, const char * const home, struct gpgworker_job * const job) {
+	if (ctx == NULL) {
+		job->result = -1;
+		return;
+	}
+	
+	switch (job->type) {
+		case GPGWORKER_EXPORT:{
+			/* gpg output goes to the network thread as it comes, never whole in memory */
+			gpgme_data_t d = NULL;
+			gpgme_error_t gerr = gpgsession_stream_sink(job->stream, &d);
+			if (gerr) {
+				fprintf(stderr, "failed to write key stream: (%d) %s\n", gerr, gpgme_strerror(gerr));
+				job->result = -1;
+			}else{
+				job->result = gpgsession_export_data(ctx, job->fpr, d);
+			}
+			gpgme_data_release(d);
+			gpgsession_stream_close(job->stream, job->result == 0);
+			break;
+		}
+		case GPGWORKER_IMPORT:
+			gpgsession_keyring_stamp(home, &job->before);
+			if (job->stream != NULL) {
+				gpgme_data_t d = NULL;
+				gpgme_error_t gerr = gpgsession_stream_data(job->stream, &d);
+				if (!gerr) {
+					gerr = gpgme_data_set_encoding(d, GPGME_DATA_ENCODING_BINARY); //decoded by the importer
+				}
+				if (gerr) {
+					fprintf(stderr, "failed to read key stream: (%d) %s\n", gerr, gpgme_strerror(gerr));
+					job->result = -1;
+				}else{
+					job->result = gpgsession_import_data(ctx, d, &job->imports, &job->number_of_imports);
+				}
+				gpgme_data_release(d);
+				gpgsession_stream_done(job->stream);
+			}else{
+				gpgme_data_t d = NULL;
+				gpgme_error_t gerr = gpgme_data_new_from_mem(&d, job->data, job->length, 0);
+				if (gerr) {
+					fprintf(stderr, "Failed to allocate new gpgme_data_t: (%d) %s\n", gerr, gpgme_strerror(gerr));
+					job->result = -1;
+				}else{
+					job->result = gpgsession_import_data(ctx, d, &job->imports, &job->number_of_imports);
+				}
+				gpgme_data_release(d);
+			}
+			job->imported = gpgsession_count_imported(job->imports, job->number_of_imports);
+			gpgsession_keyring_stamp(home, &job->after);
+			list_imported(ctx, job);
+			break;
+		case GPGWORKER_LIST:
+			gpgsession_keyring_stamp(home, &job->before); //changes from now on are listed, or seen again
+			job->result = gpgsession_keycache_list(ctx, home, &job->keys, &job->number_of_keys);
+			break;
+		case GPGWORKER_DETAILS:
+			gpgsession_keyring_stamp(home, &job->before);
+			job->details = gpgsession_get_key_details(ctx, job->fpr);
+			job->result = job->details == NULL ? -1 : 0;
+			break;
+		default:
+			job->result = -1;
+	}
+}
+
+static void *worker_main(void *arg) {
+	struct gpgworker_pool * const pool = arg;
+	
+	for (;;) {
+		while (sem_wait(&pool->pending) == -1 && errno == EINTR) {
+		}
+		if (atomic_load(&pool->stop)) {
+			break;
+		}
+		
+		struct gpgworker_job *job = queue_pop(&pool->submitted);
+		if (job == NULL) {
+			continue;
+		}
+		
+		/* contexts are ready in the pool, a job pays no setup; more workers than contexts just wait here */
+		gpgme_ctx_t *ctx = gpgsession_pool_acquire(pool->contexts);
+		run_job(ctx, gpgsession_pool_home(pool->contexts), job);
+		gpgsession_pool_release(pool->contexts, ctx);
+		
+		queue_push(&pool->completed, job); //can not fail, see in_flight
+		
+		uint64_t one = 1;
+		if (write(pool->event_fd, &one, sizeof(one)) != sizeof(one)) {
+			perror("failed to signal gpg job completion");
+		}
+	}
+	
+	return NULL;
+}
+
+int gpgworker_pool_new(struct gpgworker_pool **pool, const size_t threads, struct gpgsession_pool * const contexts) {
+	if (pool == NULL || threads == 0 || contexts == NULL) {
+		fprintf(stderr, "gpg worker pool must be not null and have at least one thread\n");
+		return -1;
+	}
+	
+	*pool = calloc(1, sizeof(struct gpgworker_pool));
+	if (*pool == NULL) {
+		perror("failed to allocate gpg worker pool, out of RAM?");
+		return -1;
+	}
+	struct gpgworker_pool * const p = *pool;
+	p->event_fd = -1;
+	p->contexts = contexts;
+	p->stall_ms = IMPORT_STALL_MS;
+	
+	queue_init(&p->submitted);
+	queue_init(&p->completed);
+	atomic_init(&p->in_flight, 0);
+	atomic_init(&p->imports, 0);
+	atomic_init(&p->stop, false);
+	
+	if (sem_init(&p->pending, 0, 0)) {
+		perror("sem_init()");
+		free(p);
+		*pool = NULL;
+		return -1;
+	}
+	
+	p->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (p->event_fd == -1) {
+		perror("eventfd()");
+		goto fail;
+	}
+	
+	p->threads = calloc(threads, sizeof(pthread_t));
+	if (p->threads == NULL) {
+		perror("failed to allocate gpg workers, out of RAM?");
+		goto fail;
+	}
+	
+	for (; p->number_of_threads < threads; p->number_of_threads++) {
+		int rc = pthread_create(&p->threads[p->number_of_threads], NULL, worker_main, p);
+		if (rc) {
+			fprintf(stderr, "failed to start gpg worker: (%d) %s\n", rc, strerror(rc));
+			goto fail;
+		}
+	}
+	
+	return 0;
+	
+	fail:
+	gpgworker_pool_free(pool);
+	return -1;
+}
+
+void gpgworker_pool_free(struct gpgworker_pool **pool) {
+	if (pool == NULL || *pool == NULL) {
+		return;
+	}
+	struct gpgworker_pool * const p = *pool;
+	
+	atomic_store(&p->stop, true);
+	for (size_t i = 0; i < p->number_of_threads; i++) {
+		sem_post(&p->pending);
+	}
+	for (size_t i = 0; i < p->number_of_threads; i++) {
+		pthread_join(p->threads[i], NULL);
+	}
+	free(p->threads);
+	
+	struct gpgworker_job *job;
+	while ((job = queue_pop(&p->submitted)) != NULL) {
+		gpgworker_job_free(job);
+	}
+	while ((job = queue_pop(&p->completed)) != NULL) {
+		gpgworker_job_free(job);
+	}
+	
+	if (p->event_fd != -1) {
+		close(p->event_fd);
+	}
+	sem_destroy(&p->pending);
+	free(p);
+	*pool = NULL;
+}
+
+void gpgworker_set_stall_timeout(struct gpgworker_pool *pool, const unsigned int ms) {
+	pool->stall_ms = ms;
+}
+
+/* called by a worker when the network thread can go on with a stream */
+static void pool_wake(void *arg) {
+	struct gpgworker_pool * const pool = arg;
+	uint64_t one = 1;
+	
+	if (write(pool->event_fd, &one, sizeof(one)) != sizeof(one)) {
+		perror("failed to signal gpg stream");
+	}
+}
+
+struct gpgworker_job *gpgworker_job_export(struct gpgworker_pool *pool, const char * const fpr, const unsigned int tag, struct gpgsession_stream **stream) {
+	struct gpgworker_job *job = calloc(1, sizeof(struct gpgworker_job));
+	if (job == NULL) {
+		perror("failed to allocate gpg job, out of RAM?");
+		return NULL;
+	}
+	job->type = GPGWORKER_EXPORT;
+	job->tag = tag;
+	job->fpr = strdup(fpr);
+	if (job->fpr == NULL) {
+		perror("failed to allocate gpg job, out of RAM?");
+		free(job);
+		return NULL;
+	}
+	if (gpgsession_stream_new(&job->stream, STREAM_CAPACITY, pool_wake, pool)) {
+		free(job->fpr);
+		free(job);
+		return NULL;
+	}
+	gpgsession_stream_ref(job->stream);
+	*stream = job->stream;
+	return job;
+}
+
+struct gpgworker_job *gpgworker_job_import(const char * const data, const size_t length, const unsigned int tag) {
+	struct gpgworker_job *job = calloc(1, sizeof(struct gpgworker_job));
+	if (job == NULL) {
+		perror("failed to allocate gpg job, out of RAM?");
+		return NULL;
+	}
+	job->type = GPGWORKER_IMPORT;
+	job->tag = tag;
+	job->data = malloc(length);
+	if (job->data == NULL) {
+		perror("failed to allocate gpg job, out of RAM?");
+		free(job);
+		return NULL;
+	}
+	memcpy(job->data, data, length);
+	job->length = length;
+	return job;
+}
+
+struct gpgworker_job *gpgworker_job_import_stream(struct gpgsession_stream * const stream, const unsigned int tag) {
+	struct gpgworker_job *job = calloc(1, sizeof(struct gpgworker_job));
+	if (job == NULL) {
+		perror("failed to allocate gpg job, out of RAM?");
+		return NULL;
+	}
+	job->type = GPGWORKER_IMPORT;
+	job->tag = tag;
+	gpgsession_stream_ref(stream);
+	job->stream = stream;
+	return job;
+}
+
+struct gpgworker_job *gpgworker_job_list(const unsigned int tag) {
+	struct gpgworker_job *job = calloc(1, sizeof(struct gpgworker_job));
+	if (job == NULL) {
+		perror("failed to allocate gpg job, out of RAM?");
+		return NULL;
+	}
+	job->type = GPGWORKER_LIST;
+	job->tag = tag;
+	return job;
+}
+
+struct gpgworker_job *gpgworker_job_details(const char * const fpr, const unsigned int tag) {
+	struct gpgworker_job *job = calloc(1, sizeof(struct gpgworker_job));
+	if (job == NULL) {
+		perror("failed to allocate gpg job, out of RAM?");
+		return NULL;
+	}
+	job->type = GPGWORKER_DETAILS;
+	job->tag = tag;
+	job->fpr = strdup(fpr);
+	if (job->fpr == NULL) {
+		perror("failed to allocate gpg job, out of RAM?");
+		free(job);
+		return NULL;
+	}
+	return job;
+}
+
+void gpgworker_job_free(struct gpgworker_job *job) {
+	if (job == NULL) {
+		return;
+	}
+	if (job->stream != NULL && job->type == GPGWORKER_EXPORT) {
+		gpgsession_stream_close(job->stream, false); //a job never run must not leave the reader waiting
+		gpgsession_stream_unref(job->stream);
+	}else if (job->stream != NULL) {
+		gpgsession_stream_done(job->stream); //a job never run must not hold the producer
+		gpgsession_stream_unref(job->stream);
+	}
+	free(job->fpr);
+	free(job->data);
+	gpgsession_free_import_status(&job->imports, job->number_of_imports);
+	gpgsession_keycache_free_list(job->keys, job->number_of_keys);
+	if (job->details != NULL) {
+		gpgme_key_release(job->details);
+	}
+	free(job);
+}
+
+int gpgworker_submit(struct gpgworker_pool *pool, struct gpgworker_job *job) {
+	if (atomic_fetch_add(&pool->in_flight, 1) >= QUEUE_SIZE) {
+		atomic_fetch_sub(&pool->in_flight, 1);
+		fprintf(stderr, "too many gpg jobs pending\n");
+		return -1;
+	}
+	
+	if (!queue_push(&pool->submitted, job)) {
+		atomic_fetch_sub(&pool->in_flight, 1);
+		fprintf(stderr, "gpg job queue full\n");
+		return -1;
+	}
+	
+	if (job->type == GPGWORKER_IMPORT) {
+		atomic_fetch_add(&pool->imports, 1);
+	}
+	sem_post(&pool->pending);
+	return 0;
+}
+
+int gpgworker_completion_fd(struct gpgworker_pool *pool) {
+	return pool->event_fd;
+}
+
+void gpgworker_ack(struct gpgworker_pool *pool) {
+	uint64_t count;
+	if (read(pool->event_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+		perror("failed to read gpg job completion");
+	}
+}
+
+struct gpgworker_job *gpgworker_next_completed(struct gpgworker_pool *pool) {
+	struct gpgworker_job *job = queue_pop(&pool->completed);
+	if (job != NULL) {
+		atomic_fetch_sub(&pool->in_flight, 1);
+	}
+	if (job != NULL && job->type == GPGWORKER_IMPORT) {
+		atomic_fetch_sub(&pool->imports, 1);
+	}
+	return job;
+}
+
+bool gpgworker_importing(struct gpgworker_pool *pool) {
+	return atomic_load(&pool->imports) > 0;
+}
+
+struct gpgworker_importer{
+	struct gpgworker_pool *pool;
+	unsigned int tag;
+	
+	/* the batch: every good block goes in the same stream, read by one gpg import */
+	struct gpgsession_stream *stream;
+	struct gpgworker_job *job; //its import, not submitted yet
+	size_t blocks; //complete blocks in the batch
+	bool flush; //close the batch once the block in progress ends
+	
+	/* the block in progress */
+	bool in_block;
+	size_t mark; //where it starts in the stream
+	struct armor_decoder decoder;
+};
+
+int gpgworker_importer_new(struct gpgworker_importer **importer, struct gpgworker_pool * const pool, const unsigned int tag) {
+	if (importer == NULL || pool == NULL) {
+		fprintf(stderr, "importer and pool must be not null\n");
+		return -1;
+	}
+	
+	*importer = calloc(1, sizeof(struct gpgworker_importer));
+	if (*importer == NULL) {
+		perror("failed to allocate importer, out of RAM?");
+		return -1;
+	}
+	(*importer)->pool = pool;
+	(*importer)->tag = tag;
+	
+	return 0;
+}
+
+/* drop the whole batch */
+static void importer_reset(struct gpgworker_importer * const importer) {
+	if (importer->stream == NULL) {
+		return;
+	}
+	gpgsession_stream_close(importer->stream, false);
+	gpgworker_job_free(importer->job);
+	importer->job = NULL;
+	gpgsession_stream_unref(importer->stream);
+	importer->stream = NULL;
+	importer->blocks = 0;
+	importer->flush = false;
+	importer->in_block = false;
+}
+
+static int importer_submit(struct gpgworker_importer * const importer) {
+	struct gpgworker_job *job = importer->job;
+	
+	importer->job = NULL;
+	if (gpgworker_submit(importer->pool, job)) {
+		gpgworker_job_free(job);
+		return -1;
+	}
+	return 0;
+}
+
+int gpgworker_importer_flush(struct gpgworker_importer * const importer) {
+	if (importer->stream == NULL) {
+		return 0;
+	}
+	if (importer->in_block) {
+		importer->flush = true; //can not cut a block, see importer_end()
+		return 0;
+	}
+	if (importer->blocks == 0) {
+		importer_reset(importer);
+		return 0;
+	}
+	
+	int rc = 0;
+	gpgsession_stream_close(importer->stream, true);
+	if (importer->job != NULL) {
+		rc = importer_submit(importer);
+	}
+	gpgsession_stream_unref(importer->stream);
+	importer->stream = NULL;
+	importer->blocks = 0;
+	importer->flush = false;
+	
+	return rc;
+}
+
+bool gpgworker_importer_pending(const struct gpgworker_importer * const importer) {
+	return importer->blocks > 0 && !importer->in_block;
+}
+
+void gpgworker_importer_free(struct gpgworker_importer **importer) {
+	if (importer == NULL || *importer == NULL) {
+		return;
+	}
+	
+	if ((*importer)->in_block) {
+		fprintf(stderr, "importer freed in the middle of a block, dropping the whole batch\n");
+		importer_reset(*importer);
+	}
+	gpgworker_importer_flush(*importer); //what was received whole is still imported
+	free(*importer);
+	*importer = NULL;
+}
+
+/* 
+ * gpg is about to read the block in progress before it is checked: the good
+ * blocks before it go to an import of their own, so if this one turns out bad
+ * dropping it takes nothing else down.
+ */
+static int importer_split(struct gpgworker_importer * const importer) {
+	struct gpgsession_stream *tail = NULL;
+	
+	if (gpgsession_stream_split(importer->stream, importer->mark, &tail)) {
+		return -1;
+	}
+	struct gpgworker_job *job = gpgworker_job_import_stream(tail, importer->tag);
+	if (job == NULL) {
+		gpgsession_stream_unref(tail);
+		return -1;
+	}
+	
+	gpgsession_stream_close(importer->stream, true);
+	int rc = importer_submit(importer);
+	gpgsession_stream_unref(importer->stream);
+	importer->stream = tail;
+	importer->job = job;
+	importer->blocks = 0;
+	importer->mark = 0;
+	
+	return rc;
+}
+
+static int importer_begin(void * const opaque) {
+	struct gpgworker_importer * const importer = opaque;
+	
+	/* same when gpg already reads the batch: the next block starts a new one */
+	if (importer->stream != NULL && importer->job == NULL) {
+		gpgworker_importer_flush(importer);
+	}
+	
+	if (importer->stream == NULL) {
+		if (gpgsession_stream_new(&importer->stream, STREAM_CAPACITY, pool_wake, importer->pool)) {
+			return -1;
+		}
+		gpgsession_stream_set_timeout(importer->stream, importer->pool->stall_ms);
+		
+		/* gpg is only started once the batch is known good, or too big to wait for its end */
+		importer->job = gpgworker_job_import_stream(importer->stream, importer->tag);
+		if (importer->job == NULL) {
+			gpgsession_stream_unref(importer->stream);
+			importer->stream = NULL;
+			return -1;
+		}
+	}
+	
+	importer->in_block = true;
+	importer->mark = gpgsession_stream_written(importer->stream);
+	armor_decoder_init(&importer->decoder);
+	
+	return 0;
+}
+
+static ssize_t importer_data(void * const opaque, const char * const data, const size_t length) {
+	struct gpgworker_importer * const importer = opaque;
+	uint8_t decoded[DECODE_CHUNK];
+	size_t taken = 0;
+	
+	/* a chunk at a time until the span is consumed or the stream is full */
+	while (taken < length) {
+		/* never decode more than the stream can take, the decoded bytes can not be given back */
+		size_t room = gpgsession_stream_room(importer->stream, sizeof(decoded));
+		size_t limit = room < sizeof(decoded) ? room : sizeof(decoded);
+		size_t n = limit < 3 ? 0 : (limit - 3) / 3 * 4;
+		if (n > length - taken) {
+			n = length - taken;
+		}
+		if (n == 0) {
+			break; //full, the room check armed the wake, wait for the worker
+		}
+		
+		ssize_t written = armor_decode(&importer->decoder, data + taken, n, decoded);
+		if (written < 0) {
+			fprintf(stderr, "invalid radix-64 data in key block\n");
+			return -1;
+		}
+		gpgsession_stream_write(importer->stream, decoded, written);
+		taken += n;
+		
+		if (importer->job != NULL && gpgsession_stream_length(importer->stream) >= STREAM_CAPACITY / 2) {
+			if (importer->blocks > 0 && importer_split(importer)) {
+				return -1;
+			}
+			if (importer_submit(importer)) {
+				return -1;
+			}
+		}
+	}
+	
+	return taken;
+}
+
+static void importer_end(void * const opaque, const bool complete) {
+	struct gpgworker_importer * const importer = opaque;
+	
+	if (importer->stream == NULL || !importer->in_block) {
+		return;
+	}
+	importer->in_block = false;
+	
+	if (!complete || armor_decoder_finish(&importer->decoder)) {
+		if (complete) {
+			fprintf(stderr, "key block rejected, bad checksum\n");
+		}
+		/* cut the block out of the batch; if gpg already read part of it, it is alone in the batch, see importer_split() */
+		if (gpgsession_stream_truncate(importer->stream, importer->mark)) {
+			importer_reset(importer);
+			return;
+		}
+	}else{
+		importer->blocks++;
+	}
+	
+	if (importer->flush) {
+		gpgworker_importer_flush(importer);
+	}
+}
+
+const struct gpgsession_parser_sink gpgworker_importer_sink = {
+	.begin = importer_begin,
+	.data = importer_data,
+	.end = importer_end,
+};
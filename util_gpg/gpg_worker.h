@@ -0,0 +1,119 @@
+#ifndef GPG_WORKER_H
+#define GPG_WORKER_H
+
+#include "util_gpg/gpg_pool.h"
+#include "util_gpg/gpg_session.h"
+#include "util_gpg/gpg_stream.h"
+#include "util_gpg/gpg_keybox.h"
+#include "util_gpg/gpg_watch.h"
+
+#include <gpgme.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* 
+ * Pool of threads running the slow gpgme operations (export/import/list/details), so the
+ * network thread never waits on gpg. Jobs are submitted and completed through
+ * lock-free queues, completions are signalled on an eventfd that can be
+ * watched by the event loop. Every job borrows a context from a gpgsession_pool.
+ */
+
+enum gpgworker_job_type{
+	GPGWORKER_EXPORT,
+	GPGWORKER_IMPORT,
+	GPGWORKER_LIST,
+	GPGWORKER_DETAILS
+};
+
+struct gpgworker_job{
+	enum gpgworker_job_type type;
+	unsigned int tag; //free for the caller, ie. the session waiting for the result
+	
+	/* input, owned by the job */
+	char *fpr; //GPGWORKER_EXPORT, GPGWORKER_DETAILS
+	char *data; //GPGWORKER_IMPORT
+	size_t length;
+	struct gpgsession_stream *stream; //GPGWORKER_IMPORT: read instead of data when not NULL, GPGWORKER_EXPORT: written
+	
+	/* output, valid once the job is completed */
+	int result; //0 on success
+	int imported; //GPGWORKER_IMPORT, number of keys imported
+	struct gpgsession_import_status *imports; //GPGWORKER_IMPORT, one per key found
+	size_t number_of_imports;
+	struct gpgsession_keyinfo **keys; //GPGWORKER_IMPORT: the secret keys imported as gpg lists them now, for gpgsession_keycache_update(); GPGWORKER_LIST: all of them, for gpgsession_keycache_refresh()
+	size_t number_of_keys;
+	gpgme_key_t details; //GPGWORKER_DETAILS, NULL if gpg does not have the key; released with the job unless taken
+	struct gpgsession_keyring_stamp before; //GPGWORKER_IMPORT, GPGWORKER_LIST, GPGWORKER_DETAILS: the keyring files before gpg ran
+	struct gpgsession_keyring_stamp after; //GPGWORKER_IMPORT
+};
+
+struct gpgworker_pool;
+
+int gpgworker_pool_new(struct gpgworker_pool **pool, const size_t threads, struct gpgsession_pool * const contexts);
+void gpgworker_pool_free(struct gpgworker_pool **pool);
+
+/* 
+ * Export the secret key matching fpr into a new stream, to be read with
+ * gpgsession_stream_read() while gpg writes it; the completion fd becomes
+ * readable when there is more. The caller gets its own reference of the stream.
+ */
+struct gpgworker_job *gpgworker_job_export(struct gpgworker_pool *pool, const char * const fpr, const unsigned int tag, struct gpgsession_stream **stream);
+/* import the given armored data, it is copied */
+struct gpgworker_job *gpgworker_job_import(const char * const data, const size_t length, const unsigned int tag);
+/* import what is written in the stream while the job runs, the job takes a reference */
+struct gpgworker_job *gpgworker_job_import_stream(struct gpgsession_stream * const stream, const unsigned int tag);
+/* list the whole secret keyring, ie. after another program changed it */
+struct gpgworker_job *gpgworker_job_list(const unsigned int tag);
+/* full key with signatures and validity, see gpgsession_get_key_details() */
+struct gpgworker_job *gpgworker_job_details(const char * const fpr, const unsigned int tag);
+void gpgworker_job_free(struct gpgworker_job *job);
+
+/* the pool takes ownership of the job until it is returned by gpgworker_next_completed() */
+int gpgworker_submit(struct gpgworker_pool *pool, struct gpgworker_job *job);
+
+/* readable when some job is completed */
+int gpgworker_completion_fd(struct gpgworker_pool *pool);
+
+/* clear the completion fd, call it before draining gpgworker_next_completed() */
+void gpgworker_ack(struct gpgworker_pool *pool);
+
+/* next completed job or NULL, the caller must gpgworker_job_free() it */
+struct gpgworker_job *gpgworker_next_completed(struct gpgworker_pool *pool);
+
+/* 
+ * An import reading a block before its end waits at most ms for more of it, 10 s
+ * by default, then fails: the worker is not held by a client gone silent.
+ * 0 waits forever. Applies to the importers' batches started afterwards.
+ */
+void gpgworker_set_stall_timeout(struct gpgworker_pool *pool, const unsigned int ms);
+
+/* true while import jobs are submitted and not collected yet: the keyring changes seen meanwhile may be theirs */
+bool gpgworker_importing(struct gpgworker_pool *pool);
+
+/* 
+ * Parser sink streaming the key blocks to an import job as they arrive: a
+ * block is never held whole in memory. Consecutive blocks are batched in the
+ * same import until gpgworker_importer_flush(), so a bulk transfer costs one
+ * gpg run; a block gpg has to start on before its end is checked goes to an
+ * import of its own, so a bad one never takes the good ones down with it.
+ * When the stream is full the parser is paused; the completion fd
+ * becomes readable once there is room again, and gpgworker_next_completed()
+ * may then return nothing.
+ */
+struct gpgworker_importer;
+
+int gpgworker_importer_new(struct gpgworker_importer **importer, struct gpgworker_pool * const pool, const unsigned int tag);
+/* a block still in progress is dropped, the complete ones are imported */
+void gpgworker_importer_free(struct gpgworker_importer **importer);
+
+/* end of the batch: import what was received, or once the block in progress ends */
+int gpgworker_importer_flush(struct gpgworker_importer * const importer);
+
+/* true when complete blocks wait for gpgworker_importer_flush() */
+bool gpgworker_importer_pending(const struct gpgworker_importer * const importer);
+
+/* opaque is the gpgworker_importer */
+extern const struct gpgsession_parser_sink gpgworker_importer_sink;
+
+#endif
@@ -0,0 +1,340 @@
+#include "util_gpg/gpg_session.h"
+#include "util_gpg/armor.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Throughput of the import parser: synthetic armored keyrings, from a single
+ * key to 10k keys plus a few oversized blocks, fed to gpgsession_parser_feed()
+ * in chunks from 1 byte to 64 KiB. Parsing alone, parsing and radix-64
+ * decoding. With -k, copies of a real key imported into ephemeral GnuPG homes
+ * instead: one gpg run per key or one for all. One line of JSON per measure.
+ */
+
+#define KEY_BYTES 2600              /* binary size of a usual RSA 2048 secret key */
+#define OVERSIZED_BYTES (1 << 20)   /* a key with a photo ID or many subkeys */
+#define MIN_SECONDS 0.05            /* short runs are repeated up to this */
+
+const size_t keyring_sizes[] = { 1, 10, 100, 1000, 10000 };
+const size_t chunk_sizes[] = { 1, 16, 256, 4096, 65536 };
+
+enum bench_mode{ PARSE, DECODE, IMPORT_PER_KEY, IMPORT_BATCHED };
+const char * const mode_names[] = { [PARSE] = "parse", [DECODE] = "decode", [IMPORT_PER_KEY] = "import_per_key", [IMPORT_BATCHED] = "import_batched" };
+
+/* what the parser hands over, decoded or only counted */
+struct bench_sink{
+	enum bench_mode mode;
+	struct armor_decoder decoder;
+	uint8_t *buffer;
+	size_t length;
+	size_t size;
+	size_t key_start; //where the block in progress starts in buffer
+	size_t keys; //complete blocks
+	size_t broken;
+	gpgme_ctx_t *ctx;
+};
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int import_buffer(gpgme_ctx_t * const ctx, const uint8_t * const data, const size_t length) {
+	gpgme_data_t d = NULL;
+
+	if (gpgme_data_new_from_mem(&d, (const char *)data, length, 0)) {
+		return -1;
+	}
+	int rc = gpgsession_import_data(ctx, d, NULL, NULL);
+	gpgme_data_release(d);
+	return rc;
+}
+
+static int sink_begin(void * const opaque) {
+	struct bench_sink * const sink = opaque;
+	sink->key_start = sink->length;
+	armor_decoder_init(&sink->decoder);
+	return 0;
+}
+
+static ssize_t sink_data(void * const opaque, const char * const data, const size_t length) {
+	struct bench_sink * const sink = opaque;
+
+	if (sink->mode == PARSE) {
+		return length;
+	}
+
+	size_t needed = sink->length + ARMOR_DECODED_SIZE(length);
+	if (needed > sink->size) {
+		size_t size = sink->size ? sink->size : 4096;
+		while (size < needed) {
+			size *= 2;
+		}
+		uint8_t *tmp = realloc(sink->buffer, size);
+		if (tmp == NULL) {
+			perror("failed to grow key buffer, out of RAM?");
+			return -1;
+		}
+		sink->buffer = tmp;
+		sink->size = size;
+	}
+	ssize_t written = armor_decode(&sink->decoder, data, length, sink->buffer + sink->length);
+	if (written < 0) {
+		return -1;
+	}
+	sink->length += written;
+	return length;
+}
+
+static void sink_end(void * const opaque, const bool complete) {
+	struct bench_sink * const sink = opaque;
+
+	if (!complete || (sink->mode != PARSE && armor_decoder_finish(&sink->decoder))) {
+		sink->broken++;
+		sink->length = sink->key_start;
+		return;
+	}
+	sink->keys++;
+
+	if (sink->mode == IMPORT_PER_KEY) {
+		import_buffer(sink->ctx, sink->buffer + sink->key_start, sink->length - sink->key_start);
+	}
+	if (sink->mode != IMPORT_BATCHED) {
+		sink->length = 0; //only the batched import keeps them all
+	}
+}
+
+static const struct gpgsession_parser_sink bench_sink = {
+	.begin = sink_begin,
+	.data = sink_data,
+	.end = sink_end,
+};
+
+/* xorshift, the content does not matter but must not be the same byte over and over */
+static uint64_t random_state = 0x9E3779B97F4A7C15ULL;
+static uint8_t random_byte(void) {
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 7;
+	random_state ^= random_state << 17;
+	return random_state >> 56;
+}
+
+struct text{
+	char *data;
+	size_t length;
+	size_t size;
+};
+
+static int text_append(struct text * const text, const char * const data, const size_t length) {
+	if (text->length + length > text->size) {
+		size_t size = text->size ? text->size : 65536;
+		while (size < text->length + length) {
+			size *= 2;
+		}
+		char *tmp = realloc(text->data, size);
+		if (tmp == NULL) {
+			perror("failed to grow the keyring, out of RAM?");
+			return -1;
+		}
+		text->data = tmp;
+		text->size = size;
+	}
+	memcpy(text->data + text->length, data, length);
+	text->length += length;
+	return 0;
+}
+
+/* one armored block as gpg writes it: header, 64 columns of radix-64, checksum */
+static int append_block(struct text * const text, const size_t length) {
+	static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	static const char header[] = GPGSESSION_ARMOR_BEGIN "Comment: synthetic benchmark key\n\n";
+	char line[66];
+	size_t column = 0;
+	uint32_t crc = ARMOR_CRC24_INIT;
+
+	if (text_append(text, header, sizeof(header) - 1)) {
+		return -1;
+	}
+	for (size_t i = 0; i < length; i += 3) {
+		uint8_t group[3] = { random_byte(), random_byte(), random_byte() };
+		size_t n = length - i < 3 ? length - i : 3;
+		uint32_t bits = group[0] << 16 | (n > 1 ? group[1] << 8 : 0) | (n > 2 ? group[2] : 0);
+		crc = armor_crc24(crc, group, n);
+
+		line[column++] = digits[bits >> 18 & 0x3F];
+		line[column++] = digits[bits >> 12 & 0x3F];
+		line[column++] = n > 1 ? digits[bits >> 6 & 0x3F] : '=';
+		line[column++] = n > 2 ? digits[bits & 0x3F] : '=';
+		if (column == 64 || i + 3 >= length) {
+			line[column++] = '\n';
+			if (text_append(text, line, column)) {
+				return -1;
+			}
+			column = 0;
+		}
+	}
+
+	char checksum[8] = { '=', digits[crc >> 18 & 0x3F], digits[crc >> 12 & 0x3F], digits[crc >> 6 & 0x3F], digits[crc & 0x3F], '\n' };
+	if (text_append(text, checksum, 6)) {
+		return -1;
+	}
+	return text_append(text, GPGSESSION_ARMOR_END, GPGSESSION_ARMOR_END_LENGTH);
+}
+
+/* feed the whole keyring chunk by chunk, return the seconds it took */
+static double feed(struct bench_sink * const sink, const struct text * const keyring, const size_t chunk) {
+	struct gpgsession_parser *parser = NULL;
+
+	if (gpgsession_parser_new(&parser, &bench_sink, sink)) {
+		return -1;
+	}
+	sink->keys = sink->broken = sink->length = 0;
+
+	double start = now();
+	for (size_t offset = 0; offset < keyring->length; offset += chunk) {
+		size_t length = keyring->length - offset < chunk ? keyring->length - offset : chunk;
+		gpgsession_parser_feed(parser, keyring->data + offset, length);
+	}
+	gpgsession_parser_free(&parser);
+	if (sink->mode == IMPORT_BATCHED && sink->length > 0) {
+		import_buffer(sink->ctx, sink->buffer, sink->length);
+	}
+	return now() - start;
+}
+
+static void report(const char * const keyring, const enum bench_mode mode, const size_t keys, const size_t bytes, const size_t chunk, const double seconds, const struct bench_sink * const sink) {
+	printf("{\"keyring\": \"%s\", \"mode\": \"%s\", \"keys\": %zu, \"bytes\": %zu, \"chunk\": %zu, \"seconds\": %.6f, "
+		"\"mb_per_sec\": %.1f, \"keys_per_sec\": %.0f, \"parsed\": %zu, \"broken\": %zu}\n",
+		keyring, mode_names[mode], keys, bytes, chunk, seconds, bytes / seconds / 1e6, keys / seconds, sink->keys, sink->broken);
+	fflush(stdout);
+}
+
+/* parse and decode, repeated until the time means something */
+static void bench_parser(const char * const name, const struct text * const keyring, const size_t keys) {
+	struct bench_sink sink = { 0 };
+
+	for (enum bench_mode mode = PARSE; mode <= DECODE; mode++) {
+		sink.mode = mode;
+		for (size_t c = 0; c < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); c++) {
+			double seconds = 0;
+			size_t runs = 0;
+			do {
+				seconds += feed(&sink, keyring, chunk_sizes[c]);
+				runs++;
+			} while (seconds < MIN_SECONDS);
+			report(name, mode, keys, keyring->length, chunk_sizes[c], seconds / runs, &sink);
+		}
+	}
+	free(sink.buffer);
+}
+
+static int read_file(const char * const path, struct text * const text) {
+	char buffer[4096];
+	ssize_t length;
+
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		fprintf(stderr, "could not read key '%s': (%d) %s\n", path, errno, strerror(errno));
+		return -1;
+	}
+	while ((length = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+		if (text_append(text, buffer, length)) {
+			fclose(f);
+			return -1;
+		}
+	}
+	fclose(f);
+	return 0;
+}
+
+/* n copies of a real key, a fresh GnuPG home for every measure so no run finds the keys already there */
+static int bench_import(const char * const path, const size_t max_keys) {
+	struct text key = { 0 };
+
+	if (read_file(path, &key) || gpgsession_init()) {
+		free(key.data);
+		return -1;
+	}
+
+	for (size_t k = 0; k < sizeof(keyring_sizes) / sizeof(keyring_sizes[0]) && keyring_sizes[k] <= max_keys; k++) {
+		struct text keyring = { 0 };
+		for (size_t i = 0; i < keyring_sizes[k]; i++) {
+			if (text_append(&keyring, key.data, key.length)) {
+				free(keyring.data);
+				free(key.data);
+				return -1;
+			}
+		}
+
+		for (enum bench_mode mode = IMPORT_PER_KEY; mode <= IMPORT_BATCHED; mode++) {
+			struct bench_sink sink = { .mode = mode };
+			gpgme_ctx_t ctx;
+			char *home = NULL;
+
+			if (gpgsession_ephemeral_home(&home) || gpgsession_new_in(&ctx, home)) {
+				free(home);
+				free(keyring.data);
+				free(key.data);
+				return -1;
+			}
+			sink.ctx = &ctx;
+			double seconds = feed(&sink, &keyring, 4096);
+			report("real", mode, keyring_sizes[k], keyring.length, 4096, seconds, &sink);
+
+			gpgme_release(ctx);
+			free(sink.buffer);
+			free(home);
+		}
+		free(keyring.data);
+	}
+	free(key.data);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	const char *key_path = NULL;
+	size_t max_import = 100;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "k:i:")) != -1) {
+		switch (opt) {
+			case 'k': key_path = optarg; break;
+			case 'i': max_import = strtoul(optarg, NULL, 10); break;
+			default:
+				fprintf(stderr, "usage: %s [-k armored secret key, import it instead of parsing synthetic keys] [-i most keys imported]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	if (key_path != NULL) {
+		return bench_import(key_path, max_import) ? 1 : 0;
+	}
+
+	for (size_t k = 0; k < sizeof(keyring_sizes) / sizeof(keyring_sizes[0]); k++) {
+		struct text keyring = { 0 };
+		for (size_t i = 0; i < keyring_sizes[k]; i++) {
+			if (append_block(&keyring, KEY_BYTES)) {
+				return 1;
+			}
+		}
+		bench_parser("synthetic", &keyring, keyring_sizes[k]);
+		free(keyring.data);
+	}
+
+	struct text oversized = { 0 };
+	for (size_t i = 0; i < 4; i++) {
+		if (append_block(&oversized, OVERSIZED_BYTES)) {
+			return 1;
+		}
+	}
+	bench_parser("oversized", &oversized, 4);
+	free(oversized.data);
+	return 0;
+}
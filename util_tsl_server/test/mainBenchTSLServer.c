@@ -0,0 +1,376 @@
+#include "util_tsl_server/tsl_server.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <gnutls/gnutls.h>
+
+/*
+ * Loopback benchmark of the TLS layer: parallel gnutls PSK clients connect,
+ * handshake, ask for a transfer and hang up, the server side is driven
+ * with server_accept()/client_update()/client_write() like skt-server does.
+ * One line of JSON per run.
+ */
+
+#define PORT 5557
+#define SEND_QUEUE 65536          /* queued before waiting for the socket, as skt-server */
+#define MAX_FDS 1024
+#define DRAIN_MS 5000             /* how long the server may lag behind the clients */
+
+struct config{
+	size_t connections;
+	size_t parallel;
+	size_t bytes; //sent to every client after the handshake, 0 for handshakes only
+	enum kex_profile kex;
+	unsigned int resumption;
+	uint16_t port;
+};
+
+struct config config = { .connections = 1000, .parallel = 8, .bytes = 65536, .kex = KEX_DEFAULT, .resumption = 0, .port = PORT };
+
+gnutls_datum_t psk;
+atomic_size_t next_connection;
+atomic_size_t failures;
+uint64_t *handshake_ns; //per connection, measured by the client from connect()
+uint64_t *transfer_ns;
+atomic_bool stop;
+struct handshake_stats server_handshakes; //sampled by the server thread once it is done
+uint64_t server_done_ns;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int connect_loopback(void) {
+	struct sockaddr_in sa = { .sin_family = AF_INET, .sin_port = htons(config.port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+	int on = 1;
+
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		return -1;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* one connection: 0 if it went through, the times are stored at index */
+static int client_run(gnutls_psk_client_credentials_t creds, gnutls_datum_t * const ticket, const size_t index) {
+	gnutls_session_t session;
+	uint8_t buffer[16384];
+	size_t received = 0;
+	int ret, rc = -1;
+
+	uint64_t start = now_ns();
+	int fd = connect_loopback();
+	if (fd == -1) {
+		return -1;
+	}
+	if (gnutls_init(&session, GNUTLS_CLIENT)) {
+		close(fd);
+		return -1;
+	}
+	gnutls_priority_set_direct(session, "NORMAL:+ECDHE-PSK:+DHE-PSK:+PSK", NULL);
+	gnutls_credentials_set(session, GNUTLS_CRD_PSK, creds);
+	gnutls_transport_set_int(session, fd);
+	if (ticket->size > 0) {
+		gnutls_session_set_data(session, ticket->data, ticket->size);
+	}
+
+	do {
+		ret = gnutls_handshake(session);
+	} while (ret < 0 && !gnutls_error_is_fatal(ret));
+	if (ret < 0) {
+		fprintf(stderr, "client handshake failed: %s\n", gnutls_strerror(ret));
+		goto end;
+	}
+	uint64_t handshaken = now_ns();
+	handshake_ns[index] = handshaken - start;
+
+	if (config.bytes > 0) {
+		if (gnutls_record_send(session, "k", 1) != 1) {
+			goto end;
+		}
+		while (received < config.bytes) {
+			ret = gnutls_record_recv(session, buffer, sizeof(buffer));
+			if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED) {
+				continue;
+			}
+			if (ret <= 0) {
+				fprintf(stderr, "transfer cut after %zu bytes: %s\n", received, gnutls_strerror(ret));
+				goto end;
+			}
+			received += ret;
+		}
+	}
+	transfer_ns[index] = now_ns() - handshaken;
+
+	if (config.resumption > 0 && ticket->size == 0) {
+		gnutls_session_get_data2(session, ticket); //the next connections of this thread resume
+	}
+	gnutls_bye(session, GNUTLS_SHUT_WR); //the server sees a clean close
+	rc = 0;
+
+	end:
+	gnutls_deinit(session);
+	close(fd);
+	return rc;
+}
+
+static void *client_thread(void *arg) {
+	gnutls_psk_client_credentials_t creds;
+	gnutls_datum_t ticket = { NULL, 0 };
+	size_t index;
+
+	gnutls_psk_allocate_client_credentials(&creds);
+	gnutls_psk_set_client_credentials(creds, "openpgp-skt", &psk, GNUTLS_PSK_KEY_RAW);
+
+	while ((index = atomic_fetch_add(&next_connection, 1)) < config.connections) {
+		if (client_run(creds, &ticket, index)) {
+			atomic_fetch_add(&failures, 1);
+		}
+	}
+
+	gnutls_free(ticket.data);
+	gnutls_psk_free_client_credentials(creds);
+	return NULL;
+}
+
+/* every connection that reached the server went through its handshake, one way or the other */
+static bool server_drained(void) {
+	struct handshake_stats stats;
+
+	server_handshake_stats(&stats);
+	return stats.full + stats.resumed + stats.failed >= config.connections - atomic_load(&failures);
+}
+
+/*
+ * The server side, single threaded like skt-server: poll() instead of epoll, every client gets config.bytes once it asks.
+ * A TLS 1.3 client is done before the server has read its Finished, so once the clients are gone the server keeps
+ * going until it has counted every handshake, or DRAIN_MS passed.
+ */
+static void *server_thread(void *arg) {
+	const int listen_fd = *(const int *)arg;
+	static size_t to_send[MAX_FDS];
+	static bool active[MAX_FDS];
+	static uint8_t payload[SEND_QUEUE];
+	struct pollfd fds[MAX_FDS];
+	uint8_t buffer[16384];
+
+	uint64_t deadline = 0;
+
+	memset(payload, 'k', sizeof(payload));
+
+	while (true) {
+		if (atomic_load(&stop)) {
+			if (deadline == 0) {
+				deadline = now_ns() + DRAIN_MS * 1000000ULL;
+			}
+			if (server_drained()) {
+				break;
+			}
+			if (now_ns() > deadline) {
+				fprintf(stderr, "the server did not see every handshake after %d ms\n", DRAIN_MS);
+				break;
+			}
+		}
+		nfds_t n = 0;
+		fds[n++] = (struct pollfd){ .fd = listen_fd, .events = POLLIN };
+		for (int fd = 0; fd < MAX_FDS; fd++) {
+			if (active[fd]) {
+				fds[n++] = (struct pollfd){ .fd = fd, .events = POLLIN | (client_pending(fd) > 0 ? POLLOUT : 0) };
+			}
+		}
+		if (poll(fds, n, atomic_load(&stop) ? 10 : 100) <= 0) {
+			continue;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			int fd;
+			while ((fd = server_accept()) != -1) {
+				if (fd >= MAX_FDS) {
+					client_close(fd);
+				}else if (fd >= 0) {
+					active[fd] = true;
+					to_send[fd] = 0;
+				}
+			}
+		}
+
+		for (nfds_t i = 1; i < n; i++) {
+			const int fd = fds[i].fd;
+			if (fds[i].revents == 0) {
+				continue;
+			}
+			if (fds[i].revents & POLLOUT && client_flush(fd) == -1) {
+				active[fd] = false;
+				continue;
+			}
+
+			int ret;
+			while ((ret = client_update(fd, buffer, sizeof(buffer))) > 0) {
+				to_send[fd] = config.bytes;
+			}
+			if (ret == -1) {
+				active[fd] = false; //the client hung up, it is closed already
+				continue;
+			}
+
+			while (to_send[fd] > 0 && client_pending(fd) < SEND_QUEUE) {
+				size_t length = to_send[fd] < sizeof(payload) ? to_send[fd] : sizeof(payload);
+				if (client_write(fd, payload, length) == -1) {
+					client_close(fd);
+					active[fd] = false;
+					break;
+				}
+				to_send[fd] -= length;
+			}
+		}
+	}
+	server_done_ns = now_ns();
+	server_handshake_stats(&server_handshakes);
+
+	for (int fd = 0; fd < MAX_FDS; fd++) {
+		if (active[fd]) {
+			client_close(fd);
+		}
+	}
+	return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* nearest rank, on a sorted array */
+static double percentile_ms(const uint64_t * const values, const size_t count, const double p) {
+	if (count == 0) {
+		return 0;
+	}
+	size_t rank = (size_t)(p / 100 * count + 0.5);
+	rank = rank == 0 ? 0 : rank - 1;
+	return values[rank < count ? rank : count - 1] / 1e6;
+}
+
+static int parse_args(int argc, char **argv) {
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:p:b:k:r:P:")) != -1) {
+		switch (opt) {
+			case 'n': config.connections = strtoul(optarg, NULL, 10); break;
+			case 'p': config.parallel = strtoul(optarg, NULL, 10); break;
+			case 'b': config.bytes = strtoul(optarg, NULL, 10); break;
+			case 'r': config.resumption = strtoul(optarg, NULL, 10); break;
+			case 'P': config.port = strtoul(optarg, NULL, 10); break;
+			case 'k':
+				if (strcmp(optarg, "default") == 0) {
+					config.kex = KEX_DEFAULT;
+				}else if (strcmp(optarg, "x25519") == 0) {
+					config.kex = KEX_X25519;
+				}else if (strcmp(optarg, "psk") == 0) {
+					config.kex = KEX_PSK;
+				}else{
+					return -1;
+				}
+				break;
+			default:
+				return -1;
+		}
+	}
+	return config.connections > 0 && config.parallel > 0 ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+	const char * const kex_names[] = { [KEX_DEFAULT] = "default", [KEX_X25519] = "x25519", [KEX_PSK] = "psk" };
+	char pskhex[PSK_BYTES*2 + 1];
+	uint8_t key[PSK_BYTES];
+	size_t key_size = sizeof(key);
+
+	if (parse_args(argc, argv)) {
+		fprintf(stderr, "usage: %s [-n connections] [-p parallel clients] [-b bytes per transfer] [-k default|x25519|psk] [-r resumption seconds] [-P port]\n", argv[0]);
+		return 1;
+	}
+
+	server_set_kex_profile(config.kex);
+	server_set_resumption(config.resumption);
+	if (server_create(pskhex, sizeof(pskhex))) {
+		return 1;
+	}
+	gnutls_datum_t hex = { (unsigned char *)pskhex, strlen(pskhex) };
+	if (gnutls_hex_decode(&hex, key, &key_size)) {
+		return 1;
+	}
+	psk = (gnutls_datum_t){ key, key_size };
+
+	int listen_fd = server_bind(config.port);
+	if (listen_fd == -1) {
+		return 1;
+	}
+
+	handshake_ns = calloc(config.connections, sizeof(uint64_t));
+	transfer_ns = calloc(config.connections, sizeof(uint64_t));
+	pthread_t *clients = calloc(config.parallel, sizeof(pthread_t));
+	if (handshake_ns == NULL || transfer_ns == NULL || clients == NULL) {
+		perror("failed to allocate the results, out of RAM?");
+		return 1;
+	}
+
+	pthread_t server;
+	pthread_create(&server, NULL, server_thread, &listen_fd);
+
+	uint64_t start = now_ns();
+	for (size_t i = 0; i < config.parallel; i++) {
+		pthread_create(&clients[i], NULL, client_thread, NULL);
+	}
+	for (size_t i = 0; i < config.parallel; i++) {
+		pthread_join(clients[i], NULL);
+	}
+	atomic_store(&stop, true);
+	pthread_join(server, NULL);
+
+	/* the run ends with the last handshake the server completed, not when the last client left */
+	double seconds = (server_done_ns - start) / 1e9;
+	const struct handshake_stats handshakes = server_handshakes;
+
+	/* failed connections left zeros, they sort first and are skipped */
+	size_t done = config.connections - atomic_load(&failures);
+	qsort(handshake_ns, config.connections, sizeof(uint64_t), compare_u64);
+	qsort(transfer_ns, config.connections, sizeof(uint64_t), compare_u64);
+	const uint64_t * const handshake = handshake_ns + (config.connections - done);
+	const uint64_t * const transfer = transfer_ns + (config.connections - done);
+
+	printf("{\"connections\": %zu, \"parallel\": %zu, \"bytes\": %zu, \"kex\": \"%s\", \"resumption\": %u, \"failed\": %zu, \"seconds\": %.3f, "
+		"\"handshakes_per_sec\": %.1f, \"handshake_ms\": {\"p50\": %.3f, \"p99\": %.3f}, "
+		"\"transfer_ms\": {\"p50\": %.3f, \"p99\": %.3f}, \"bytes_per_sec\": %.0f, "
+		"\"server\": {\"full\": %" PRIu64 ", \"resumed\": %" PRIu64 ", \"failed\": %" PRIu64 ", \"full_cpu_ms\": %.3f, \"resumed_cpu_ms\": %.3f}}\n",
+		config.connections, config.parallel, config.bytes, kex_names[config.kex], config.resumption, config.connections - done, seconds,
+		done / seconds, percentile_ms(handshake, done, 50), percentile_ms(handshake, done, 99),
+		percentile_ms(transfer, done, 50), percentile_ms(transfer, done, 99), done * config.bytes / seconds,
+		handshakes.full, handshakes.resumed, handshakes.failed,
+		handshakes.full ? handshakes.full_ns / 1e6 / handshakes.full : 0.0,
+		handshakes.resumed ? handshakes.resumed_ns / 1e6 / handshakes.resumed : 0.0);
+
+	free(handshake_ns);
+	free(transfer_ns);
+	free(clients);
+	server_close();
+	return done == config.connections ? 0 : 1;
+}
@@ -8,11 +8,27 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 #include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+#ifdef __has_include
+#if __has_include(<linux/tls.h>)
+#include <linux/tls.h>
+#endif
+#endif
+
+/* kTLS needs the headers of Linux 4.13 and a libc knowing its socket options, else gnutls keeps sending */
+#if defined(TCP_ULP) && defined(SOL_TLS) && defined(TLS_TX) && defined(TLS_SET_RECORD_TYPE)
+#define HAVE_KTLS 1
+#endif
 
 
 #include <ctype.h> //for toupper, test
@@ -24,7 +40,57 @@
 #define SOCKET_ERR(err,s) if(err==-1) {perror(s);return(-1);}
 #define MAX_BUF 1024
 
-#define MAX_CLIENTS 1
+/* concurrent TLS sessions, every further connection is refused */
+#define MAX_CLIENTS 256
+
+/* upper limit of data queued for a single client, a key export is way smaller */
+#define MAX_OUTBOUND (16 * 1024 * 1024)
+
+/* queued bytes handed to gnutls at once, it cuts them in full records */
+#define FLUSH_CHUNK (64 * 1024)
+
+/* read ahead of gnutls, one recv() brings in a couple of full records */
+#define READ_AHEAD (34 * 1024)
+
+/* plaintext of a full record, what the kernel puts in one with kTLS */
+#define KTLS_RECORD 16384
+
+/* first size of the pairing token table, doubled when half full */
+#define TOKEN_SLOTS 64
+
+/* sessions initialized ahead of the connections, see session_take() */
+#define SESSION_POOL 16
+
+/* 
+ * PSK only, no signature is ever made (TLS 1.3 in gnutls wants the
+ * signature algorithms listed all the same, -SIGN-ALL is refused)
+ */
+const char priority[] = "NORMAL:-CTYPE-ALL"
+":%SERVER_PRECEDENCE"
+":-VERS-TLS1.0:-VERS-TLS1.1:-VERS-DTLS1.0:-VERS-DTLS1.2"
+":-CURVE-SECP224R1:-CURVE-SECP192R1"
+":-3DES-CBC:-CAMELLIA-128-CBC:-CAMELLIA-256-CBC";
+
+/* key exchanges of each enum kex_profile */
+const char * const kex_priorities[] = {
+	[KEX_DEFAULT] = ":-KX-ALL:+ECDHE-PSK:+DHE-PSK",
+	[KEX_X25519] = ":-KX-ALL:+ECDHE-PSK:-GROUP-ALL:+GROUP-X25519",
+	[KEX_PSK] = ":-KX-ALL:+PSK",
+};
+
+/*
+ * In place of kex_priorities when a TLS 1.3 client resumes: plain PSK first,
+ * so the ticket alone keys the session and the (EC)DHE share is skipped if
+ * the client allows psk_ke. A client that only allows psk_dhe_ke gets it.
+ */
+const char * const resumed_priorities[] = {
+	[KEX_DEFAULT] = ":-KX-ALL:+PSK:+ECDHE-PSK:+DHE-PSK",
+	[KEX_X25519] = ":-KX-ALL:+PSK:+ECDHE-PSK:-GROUP-ALL:+GROUP-X25519",
+	[KEX_PSK] = ":-KX-ALL:+PSK",
+};
+
+/* appended unless server_set_resumption() */
+const char no_tickets[] = ":%NO_TICKETS";
 
 const char psk_id_hint[] = "openpgp-skt";
 
@@ -36,61 +102,600 @@ enum connection_status{
 
 struct session_tsl{
 	gnutls_session_t session;
-	gnutls_priority_t priority_cache;
 	enum connection_status status;
+	
+	/* outbound queue, drained by client_flush() when the socket is writable */
+	uint8_t *out;
+	size_t out_head; //first byte not yet handed to gnutls
+	size_t out_len; //bytes queued after out_head
+	size_t out_size;
+	bool uncorking; //gnutls holds records interrupted by GNUTLS_E_AGAIN, gnutls_record_uncork() must finish them first
+	bool held; //client_hold(): only full records leave
+	bool ktls; //the kernel encrypts what we send, gnutls only reads, see ktls_enable()
+	
+	/* what gnutls reads and writes through, see transport_pull() and transport_push() */
+	struct client_transport transport;
+	int fd;
+	uint8_t in[READ_AHEAD];
+	size_t in_head;
+	size_t in_len;
+	struct client_stats stats;
 };
 
 gnutls_psk_server_credentials_t creds = NULL;
-struct session_tsl * clients[FD_SETSIZE] = {0};
+gnutls_priority_t priority_cache = NULL; //parsed once for all the sessions
+gnutls_priority_t resumed_priority_cache = NULL; //switched to when the client hello carries a ticket
+gnutls_session_t session_pool[SESSION_POOL];
+size_t pooled_sessions = 0;
+struct session_tsl ** clients = NULL; //indexed by fd, grown on demand
+size_t clients_size = 0;
+size_t open_clients = 0;
 
 int listen_sd;
 
-gnutls_datum_t psk;
+/* a PSK and the identity a client sends to use it, see server_add_psk() */
+struct psk_token{
+	char identity[PSK_IDENTITY_MAX + 1];
+	uint64_t hash;
+	uint8_t key[PSK_BYTES];
+	time_t expires; //CLOCK_MONOTONIC seconds, 0 for never
+	bool one_shot;
+	bool used; //one-shot token already paired, only resumptions of that session get in
+};
 
-int get_psk_creds(gnutls_session_t session, const char* username, gnutls_datum_t* key) {
-	//skt = gnutls_session_get_ptr(session);
+/* open addressing table of the tokens by identity, NULL for an empty slot */
+struct psk_token **tokens = NULL;
+size_t token_slots = 0;
+size_t number_of_tokens = 0;
+
+struct socket_profile profile = SOCKET_PROFILE_DEFAULT;
+
+unsigned int resumption = 0; //ticket lifetime in seconds, 0 for no tickets
+enum kex_profile kex = KEX_DEFAULT;
+gnutls_datum_t ticket_key = { NULL, 0 };
+struct handshake_stats handshakes;
+
+void server_set_resumption(const unsigned int lifetime) {
+	resumption = lifetime;
+}
+
+void server_set_kex_profile(const enum kex_profile profile) {
+	kex = profile;
+}
+
+void server_handshake_stats(struct handshake_stats * const stats) {
+	*stats = handshakes;
+}
+
+void server_set_socket_profile(const struct socket_profile * const p) {
+	profile = *p;
+}
+
+/* applied to every accepted socket, a failure only costs performance */
+static void apply_socket_profile(const int fd) {
+	int on = 1;
 	
-	//if (skt->log_level > 2)
-	for (int i = 0; i < sizeof(psk_id_hint); i++) {
-		if (username[i] != psk_id_hint[i]){
-			fprintf(stderr, "sent username is invalid: %s\n", username /* dangerous: random bytes from the network! */); 
-			return -1;
+	if (profile.nodelay && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on))) {
+		perror("setsockopt(TCP_NODELAY)");
+	}
+	if (profile.send_buffer > 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &profile.send_buffer, sizeof(profile.send_buffer))) {
+		perror("setsockopt(SO_SNDBUF)");
+	}
+	if (profile.receive_buffer > 0 && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &profile.receive_buffer, sizeof(profile.receive_buffer))) {
+		perror("setsockopt(SO_RCVBUF)");
+	}
+}
+
+static ssize_t socket_recv(void * const opaque, void * const buffer, const size_t size) {
+	return recv(*(const int *)opaque, buffer, size, 0);
+}
+
+static ssize_t socket_writev(void * const opaque, const struct iovec * const iov, const int iovcnt) {
+	struct msghdr msg = { .msg_iov = (struct iovec *)iov, .msg_iovlen = iovcnt };
+	return sendmsg(*(const int *)opaque, &msg, MSG_NOSIGNAL); //a client gone must not kill the server
+}
+
+static void set_tcp_cork(const struct session_tsl * const client, int on) {
+	if (!profile.cork || client->transport.recv != socket_recv) {
+		return;
+	}
+	if (setsockopt(client->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on))) {
+		perror("setsockopt(TCP_CORK)");
+	}
+}
+
+/* gnutls asks for a record header then its body, serve both from one recv() */
+static ssize_t transport_pull(gnutls_transport_ptr_t ptr, void *data, size_t size) {
+	struct session_tsl * const client = ptr;
+	
+	if (client->in_len == 0) {
+		ssize_t ret;
+		bool direct = size >= READ_AHEAD; //no point in copying it twice
+		
+		do {
+			ret = client->transport.recv(client->transport.opaque, direct ? data : client->in, direct ? size : READ_AHEAD);
+		} while (ret == -1 && errno == EINTR);
+		client->stats.reads++;
+		
+		if (ret <= 0) {
+			gnutls_transport_set_errno(client->session, ret == -1 ? errno : 0);
+			return ret;
+		}
+		client->stats.bytes_in += ret;
+		if (direct) {
+			return ret;
 		}
+		client->in_head = 0;
+		client->in_len = ret;
 	}
-	if (strcmp(username, psk_id_hint))  {
+	
+	size_t n = client->in_len < size ? client->in_len : size;
+	memcpy(data, client->in + client->in_head, n);
+	client->in_head += n;
+	client->in_len -= n;
+	return n;
+}
+
+/* gnutls hands all the records it has ready, they leave in one syscall */
+static ssize_t transport_push(gnutls_transport_ptr_t ptr, const giovec_t *iov, int iovcnt) {
+	struct session_tsl * const client = ptr;
+	ssize_t ret;
+	
+	if (client->ktls) {
+		/* its records would be wrapped in the kernel ones, ie. a TLS 1.3 key update: the session can not go on */
+		gnutls_transport_set_errno(client->session, EIO);
 		return -1;
 	}
 	
-	key->size = psk.size;
-	key->data = gnutls_malloc(psk.size);
-	if (!key->data)
+	do {
+		ret = client->transport.writev(client->transport.opaque, (const struct iovec *)iov, iovcnt);
+	} while (ret == -1 && errno == EINTR);
+	client->stats.writes++;
+	
+	if (ret == -1) {
+		gnutls_transport_set_errno(client->session, errno);
 		return -1;
-	memcpy(key->data, psk.data, psk.size);
+	}
+	client->stats.bytes_out += ret;
+	return ret;
+}
+
+/* only used by gnutls for its timeouts, the sessions are non blocking */
+static int transport_pull_timeout(gnutls_transport_ptr_t ptr, unsigned int ms) {
+	struct session_tsl * const client = ptr;
+	
+	if (client->in_len > 0 || client->transport.recv != socket_recv) {
+		return 1; //let pull tell, it does not block
+	}
+	struct pollfd pfd = { .fd = client->fd, .events = POLLIN };
+	return poll(&pfd, 1, ms);
+}
+
+#ifdef HAVE_KTLS
+/* GCM keys: the 4 bytes salt and, in TLS 1.2 where gnutls uses the sequence number as explicit nonce, no fixed IV */
+static int ktls_fill_gcm(unsigned char * const key_out, const size_t key_size, unsigned char iv_out[8], unsigned char salt_out[4],
+		const gnutls_datum_t * const key, const gnutls_datum_t * const iv, const unsigned char seq[8], const bool tls13) {
+	if (key->size != key_size || iv->size < 4 || (tls13 && iv->size != 12)) {
+		return -1;
+	}
+	memcpy(key_out, key->data, key_size);
+	memcpy(salt_out, iv->data, 4);
+	memcpy(iv_out, tls13 ? iv->data + 4 : seq, 8);
 	return 0;
 }
 
-int server_create(char * const pskhex, size_t pskhexsz) {
-	int rc;
+/* 
+ * Hand the sending keys of a just established session to the kernel: from
+ * now on the queue goes to the socket as plaintext and the kernel makes the
+ * records. Return -1 when the kernel (no tls module), the protocol or the
+ * cipher do not allow it, gnutls keeps doing everything then.
+ */
+static int ktls_enable(struct session_tsl * const client) {
+	union {
+		struct tls12_crypto_info_aes_gcm_128 aes128;
+#ifdef TLS_CIPHER_AES_GCM_256
+		struct tls12_crypto_info_aes_gcm_256 aes256;
+#endif
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+		struct tls12_crypto_info_chacha20_poly1305 chacha;
+#endif
+	} info;
+	gnutls_datum_t iv, key;
+	unsigned char seq[8];
+	size_t size = 0;
+	uint16_t version;
+	bool tls13 = false;
+	int rc = -1;
+	
+	/* what the kernel and gnutls both know, each got TLS 1.3 and the ciphers over time */
+	switch (gnutls_protocol_get_version(client->session)) {
+		case GNUTLS_TLS1_2: version = TLS_1_2_VERSION; break;
+#if defined(TLS_1_3_VERSION) && GNUTLS_VERSION_NUMBER >= 0x030603
+		case GNUTLS_TLS1_3: version = TLS_1_3_VERSION; tls13 = true; break;
+#endif
+		default: return -1;
+	}
+	if (gnutls_record_get_state(client->session, 0, NULL, &iv, &key, seq)) {
+		return -1;
+	}
+	
+	memset(&info, 0, sizeof(info));
+	switch (gnutls_cipher_get(client->session)) {
+		case GNUTLS_CIPHER_AES_128_GCM:
+			info.aes128.info = (struct tls_crypto_info){ .version = version, .cipher_type = TLS_CIPHER_AES_GCM_128 };
+			memcpy(info.aes128.rec_seq, seq, sizeof(seq));
+			if (ktls_fill_gcm(info.aes128.key, sizeof(info.aes128.key), info.aes128.iv, info.aes128.salt, &key, &iv, seq, tls13) == 0) {
+				size = sizeof(info.aes128);
+			}
+			break;
+#ifdef TLS_CIPHER_AES_GCM_256
+		case GNUTLS_CIPHER_AES_256_GCM:
+			info.aes256.info = (struct tls_crypto_info){ .version = version, .cipher_type = TLS_CIPHER_AES_GCM_256 };
+			memcpy(info.aes256.rec_seq, seq, sizeof(seq));
+			if (ktls_fill_gcm(info.aes256.key, sizeof(info.aes256.key), info.aes256.iv, info.aes256.salt, &key, &iv, seq, tls13) == 0) {
+				size = sizeof(info.aes256);
+			}
+			break;
+#endif
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+		case GNUTLS_CIPHER_CHACHA20_POLY1305:
+			info.chacha.info = (struct tls_crypto_info){ .version = version, .cipher_type = TLS_CIPHER_CHACHA20_POLY1305 };
+			memcpy(info.chacha.rec_seq, seq, sizeof(seq));
+			if (key.size == sizeof(info.chacha.key) && iv.size == sizeof(info.chacha.iv)) {
+				memcpy(info.chacha.key, key.data, key.size);
+				memcpy(info.chacha.iv, iv.data, iv.size);
+				size = sizeof(info.chacha);
+			}
+			break;
+#endif
+		default:
+			break; //CBC and friends stay in gnutls
+	}
+	
+	if (size > 0 && setsockopt(client->fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == 0 &&
+		setsockopt(client->fd, SOL_TLS, TLS_TX, &info, size) == 0) {
+		rc = 0;
+	}
+	gnutls_memset(&info, 0, sizeof(info));
+	return rc;
+}
+
+/* the alert gnutls_bye() can not send anymore */
+static void ktls_close_notify(const int fd) {
+	unsigned char alert[2] = { 1, 0 }; //warning, close_notify
+	char control[CMSG_SPACE(sizeof(unsigned char))];
+	struct iovec iov = { .iov_base = alert, .iov_len = sizeof(alert) };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	
+	cmsg->cmsg_level = SOL_TLS;
+	cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+	*CMSG_DATA(cmsg) = 21; //alert record
+	
+	sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT); //best effort, like gnutls_bye() on a non blocking session
+}
+#else
+/* built without kTLS, a session is never handed to the kernel */
+static int ktls_enable(struct session_tsl * const client) {
+	return -1;
+}
+
+static void ktls_close_notify(const int fd) {
+}
+#endif
+
+static uint64_t token_hash(const char *identity) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (; *identity; identity++) {
+		hash ^= (uint8_t)*identity;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static time_t now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static bool token_expired(const struct psk_token * const token, const time_t t) {
+	return token->expires != 0 && t >= token->expires;
+}
+
+static void token_free(struct psk_token * const token) {
+	gnutls_memset(token, 0, sizeof(struct psk_token));
+	free(token);
+}
+
+/* slot of the token, -1 if there is none */
+static ssize_t token_find(const char * const identity) {
+	if (number_of_tokens == 0) {
+		return -1;
+	}
+	uint64_t hash = token_hash(identity);
+	size_t mask = token_slots - 1;
+	
+	for (size_t slot = hash & mask; tokens[slot] != NULL; slot = (slot + 1) & mask) {
+		if (tokens[slot]->hash == hash && strcmp(tokens[slot]->identity, identity) == 0) {
+			return slot;
+		}
+	}
+	return -1;
+}
+
+/* free the token and move back the ones probed past it, no tombstones */
+static void token_remove(size_t slot) {
+	size_t mask = token_slots - 1;
+	
+	token_free(tokens[slot]);
+	tokens[slot] = NULL;
+	number_of_tokens--;
+	
+	for (size_t next = (slot + 1) & mask; tokens[next] != NULL; next = (next + 1) & mask) {
+		size_t home = tokens[next]->hash & mask;
+		/* can it stay, ie. is its home cyclically in (slot, next]? */
+		if ((next > slot && (home <= slot || home > next)) || (next < slot && home <= slot && home > next)) {
+			tokens[slot] = tokens[next];
+			tokens[next] = NULL;
+			slot = next;
+		}
+	}
+}
+
+static void token_insert(struct psk_token * const token) {
+	size_t mask = token_slots - 1;
+	size_t slot = token->hash & mask;
+	
+	while (tokens[slot] != NULL) {
+		slot = (slot + 1) & mask;
+	}
+	tokens[slot] = token;
+	number_of_tokens++;
+}
+
+/* room for one more token: drop the expired ones, else double the table */
+static int token_reserve(void) {
+	if (token_slots > 0 && (number_of_tokens + 1) * 2 <= token_slots) {
+		return 0;
+	}
+	
+	time_t t = now();
+	for (size_t slot = 0; slot < token_slots; ) {
+		if (tokens[slot] != NULL && token_expired(tokens[slot], t)) {
+			token_remove(slot); //may move another token here, look again
+		}else{
+			slot++;
+		}
+	}
+	if (token_slots > 0 && (number_of_tokens + 1) * 2 <= token_slots) {
+		return 0;
+	}
+	
+	size_t size = token_slots ? token_slots * 2 : TOKEN_SLOTS;
+	struct psk_token **slots = calloc(size, sizeof(struct psk_token *));
+	if (slots == NULL) {
+		perror("failed to grow the pairing tokens, out of RAM?");
+		return -1;
+	}
+	struct psk_token **old = tokens;
+	size_t old_slots = token_slots;
+	tokens = slots;
+	token_slots = size;
+	number_of_tokens = 0;
+	for (size_t slot = 0; slot < old_slots; slot++) {
+		if (old[slot] != NULL) {
+			token_insert(old[slot]);
+		}
+	}
+	free(old);
+	return 0;
+}
+
+int server_add_psk(const char * const identity, char * const pskhex, size_t pskhexsz, const unsigned int lifetime, const bool one_shot) {
+	if (strlen(identity) > PSK_IDENTITY_MAX || token_find(identity) != -1) {
+		fprintf(stderr, "invalid or already used PSK identity '%s'\n", identity);
+		return -1;
+	}
+	if (token_reserve()) {
+		return -1;
+	}
+	
+	struct psk_token *token = calloc(1, sizeof(struct psk_token));
+	if (token == NULL) {
+		perror("failed to allocate pairing token, out of RAM?");
+		return -1;
+	}
+	strcpy(token->identity, identity);
+	token->hash = token_hash(identity);
+	token->expires = lifetime ? now() + lifetime : 0;
+	token->one_shot = one_shot;
 	
 	/* choose random number */  
-	rc = gnutls_key_generate(&psk, PSK_BYTES);
+	int rc = gnutls_rnd(GNUTLS_RND_KEY, token->key, sizeof(token->key));
 	if (rc) {
 		fprintf(stderr, "failed to get randomness: (%d) %s\n", rc, gnutls_strerror(rc));
+		token_free(token);
+		return -1;
 	}
 	
-	if ((rc = gnutls_hex_encode(&psk, pskhex, &pskhexsz))) {
+	const gnutls_datum_t key = { token->key, sizeof(token->key) };
+	if ((rc = gnutls_hex_encode(&key, pskhex, &pskhexsz))) {
 		fprintf(stderr, "failed to encode PSK as a hex string: (%d) %s\n", rc, gnutls_strerror(rc));
+		token_free(token);
 		return -1;
 	}
 
 	for (int ix = 0; ix < pskhexsz; ix++)
 		pskhex[ix] = toupper(pskhex[ix]);
 	
+	token_insert(token);
+	return 0;
+}
+
+int server_remove_psk(const char * const identity) {
+	ssize_t slot = token_find(identity);
+	if (slot == -1) {
+		return -1;
+	}
+	token_remove(slot);
+	return 0;
+}
+
+size_t server_psk_count(void) {
+	return number_of_tokens;
+}
+
+int get_psk_creds(gnutls_session_t session, const char* username, gnutls_datum_t* key) {
+	ssize_t slot = token_find(username);
+	if (slot == -1) {
+		fprintf(stderr, "unknown PSK identity\n"); //not printed, random bytes from the network!
+		return -1;
+	}
+	if (token_expired(tokens[slot], now())) {
+		token_remove(slot);
+		fprintf(stderr, "PSK identity '%s' expired\n", username);
+		return -1;
+	}
+	if (tokens[slot]->used) {
+		fprintf(stderr, "PSK identity '%s' already paired\n", username);
+		return -1;
+	}
+	
+	key->size = sizeof(tokens[slot]->key);
+	key->data = gnutls_malloc(key->size);
+	if (!key->data)
+		return -1;
+	memcpy(key->data, tokens[slot]->key, key->size);
+	return 0;
+}
+
+/* 
+ * The handshake proved the client has the key: a one-shot token is used up
+ * now. -1 if the token went away meanwhile (used by a concurrent handshake,
+ * removed or expired), the client must not get in.
+ */
+static int psk_claim(gnutls_session_t session) {
+	const char * const identity = gnutls_psk_server_get_username(session);
+	ssize_t slot = identity ? token_find(identity) : -1;
+	time_t t = now();
+	
+	if (slot == -1 || token_expired(tokens[slot], t)) {
+		return -1;
+	}
+	if (gnutls_session_is_resumed(session)) {
+		return 0; //a ticket from a handshake made with this token, while it lasts
+	}
+	if (kex != KEX_PSK && gnutls_kx_get(session) == GNUTLS_KX_PSK) {
+		/* the ticket was refused and resumed_priorities keyed a full handshake with the PSK alone */
+		fprintf(stderr, "PSK identity '%s' came with a stale ticket, it has to connect again without it\n", identity);
+		return -1;
+	}
+	if (tokens[slot]->used) {
+		return -1;
+	}
+	if (tokens[slot]->one_shot && resumption == 0) {
+		token_remove(slot);
+	}else if (tokens[slot]->one_shot) {
+		/* kept for the tickets of this session only, no longer than them */
+		tokens[slot]->used = true;
+		if (tokens[slot]->expires == 0 || tokens[slot]->expires > t + resumption) {
+			tokens[slot]->expires = t + resumption;
+		}
+	}
+	return 0;
+}
+
+#if GNUTLS_VERSION_NUMBER >= 0x030603
+/* pre_shared_key extension: identities longer than any of ours are tickets */
+static int offers_ticket(void *ctx, unsigned tls_id, const unsigned char *data, unsigned size) {
+	bool * const ticket = ctx;
+	
+	if (tls_id != 41 || size < 2) {
+		return 0;
+	}
+	const size_t end = 2 + (data[0] << 8 | data[1]);
+	for (size_t i = 2; i + 2 <= size && i < end; ) {
+		const size_t length = data[i] << 8 | data[i + 1];
+		*ticket |= length > PSK_IDENTITY_MAX;
+		i += 2 + length + 4; //identity, obfuscated ticket age
+	}
+	return 0;
+}
+
+/* before gnutls reads the client hello: a TLS 1.3 resumption may skip the key exchange */
+static int resumption_hook(gnutls_session_t session, unsigned int htype, unsigned when, unsigned int incoming, const gnutls_datum_t *msg) {
+	bool ticket = false;
+	
+	if (gnutls_ext_raw_parse(&ticket, offers_ticket, msg, GNUTLS_EXT_RAW_FLAG_TLS_CLIENT_HELLO) == 0 && ticket) {
+		return gnutls_priority_set(session, resumed_priority_cache);
+	}
+	return 0; //a malformed hello is gnutls' to refuse
+}
+#endif
+
+/* a gnutls session with everything a client needs but its transport */
+static int session_prepare(gnutls_session_t * const session) {
+	int rc = gnutls_init(session, GNUTLS_SERVER | GNUTLS_NONBLOCK);
+	if (rc) {
+		fprintf(stderr, "failed to init session: (%d) %s\n", rc, gnutls_strerror(rc));
+		return -1;
+	}
+	rc = gnutls_credentials_set(*session, GNUTLS_CRD_PSK, creds);
+	if (rc) {
+		fprintf(stderr, "failed to assign PSK credentials to GnuTLS server: (%d) %s\n", rc, gnutls_strerror(rc));
+		goto fail;
+	}
+	rc = gnutls_priority_set(*session, priority_cache);
+	if (rc) {
+		fprintf(stderr, "failed to assign gnutls priority: (%d) %s\n", rc, gnutls_strerror(rc));
+		goto fail;
+	}
+	gnutls_transport_set_pull_function(*session, transport_pull);
+	gnutls_transport_set_vec_push_function(*session, transport_push);
+	gnutls_transport_set_pull_timeout_function(*session, transport_pull_timeout);
+	if (resumption > 0) {
+		rc = gnutls_session_ticket_enable_server(*session, &ticket_key);
+		if (rc) {
+			fprintf(stderr, "failed to enable session tickets: (%d) %s\n", rc, gnutls_strerror(rc));
+			goto fail;
+		}
+		gnutls_db_set_cache_expiration(*session, resumption); //lifetime of the tickets
+#if GNUTLS_VERSION_NUMBER >= 0x030603
+		gnutls_handshake_set_hook_function(*session, GNUTLS_HANDSHAKE_CLIENT_HELLO, GNUTLS_HOOK_PRE, resumption_hook);
+#endif
+	}
+	return 0;
+	
+	fail:
+	gnutls_deinit(*session);
+	return -1;
+}
+
+/* top the pool up when no handshake waits, a failure only costs the next client a gnutls_init() */
+static void session_pool_fill(void) {
+	while (pooled_sessions < SESSION_POOL && session_prepare(&session_pool[pooled_sessions]) == 0) {
+		pooled_sessions++;
+	}
+}
+
+/* a gnutls session can not be used twice: clients take fresh ones from the pool, closing refills it */
+static int session_take(gnutls_session_t * const session) {
+	if (pooled_sessions > 0) {
+		*session = session_pool[--pooled_sessions];
+		return 0;
+	}
+	return session_prepare(session);
+}
+
+int server_create(char * const pskhex, size_t pskhexsz) {
+	int rc;
 	
-	//TODO: gnutls_session_set_ptr(skt->session, skt);
-	//gnutls_transport_set_pull_function(skt->session, skt_session_gnutls_pull_func);
-	//gnutls_transport_set_push_function(skt->session, skt_session_gnutls_push_func);
-	//TODO: gnutls_transport_set_ptr(skt->session, skt);
+	/* the PSK of the usual QR code: the identity every client knows, as long as the server runs */
+	if (server_add_psk(psk_id_hint, pskhex, pskhexsz, 0, false)) {
+		return -1;
+	}
 	
 	rc = gnutls_psk_allocate_server_credentials(&creds);
 	if (rc) {
@@ -102,12 +707,43 @@ int server_create(char * const pskhex, size_t pskhexsz) {
 	if (rc) {
 		fprintf(stderr, "failed to set server credentials hint to '%s', ignoring…\n", psk_id_hint);
 	}
-	rc = gnutls_psk_set_server_known_dh_params(creds, GNUTLS_SEC_PARAM_HIGH);
+	if (kex == KEX_DEFAULT) {
+		rc = gnutls_psk_set_server_known_dh_params(creds, GNUTLS_SEC_PARAM_HIGH);
+		if (rc) {
+			fprintf(stderr, "failed to set server credentials known DH params: (%d) %s\n", rc, gnutls_strerror(rc));
+			return -1;
+		}
+	}
+	gnutls_psk_set_server_credentials_function(creds, get_psk_creds);
+	
+	if (resumption > 0) {
+		/* gnutls derives the ticket encryption keys from it and rotates them */
+		rc = gnutls_session_ticket_key_generate(&ticket_key);
+		if (rc) {
+			fprintf(stderr, "failed to generate the session ticket key: (%d) %s\n", rc, gnutls_strerror(rc));
+			return -1;
+		}
+	}
+	
+	char priorities[sizeof(priority) + 64 + sizeof(no_tickets)];
+	snprintf(priorities, sizeof(priorities), "%s%s%s", priority, kex_priorities[kex], resumption > 0 ? "" : no_tickets);
+	
+	const char *error = NULL;
+	rc = gnutls_priority_init(&priority_cache, priorities, &error);
 	if (rc) {
-		fprintf(stderr, "failed to set server credentials known DH params: (%d) %s\n", rc, gnutls_strerror(rc));
+		fprintf(stderr, "failed to set up GnuTLS priority at '%s': (%d) %s\n", error ? error : "", rc, gnutls_strerror(rc));
 		return -1;
 	}
+	if (resumption > 0) {
+		snprintf(priorities, sizeof(priorities), "%s%s", priority, resumed_priorities[kex]);
+		rc = gnutls_priority_init(&resumed_priority_cache, priorities, &error);
+		if (rc) {
+			fprintf(stderr, "failed to set up GnuTLS priority at '%s': (%d) %s\n", error ? error : "", rc, gnutls_strerror(rc));
+			return -1;
+		}
+	}
 	
+	session_pool_fill();
 	return 0;
 }
 
@@ -115,6 +751,48 @@ int server_close() {
 	
 	close(listen_sd);
 	
+	for (size_t fd = 0; fd < clients_size; fd++) {
+		if (clients[fd] != NULL && clients[fd]->status != CLOSED) {
+			clients[fd]->status = CLOSED; //no bye, nobody waits for it now
+			close(fd);
+			gnutls_deinit(clients[fd]->session);
+			free(clients[fd]->out);
+		}
+		free(clients[fd]);
+	}
+	free(clients);
+	clients = NULL;
+	clients_size = open_clients = 0;
+	
+	while (pooled_sessions > 0) {
+		gnutls_deinit(session_pool[--pooled_sessions]);
+	}
+	if (priority_cache != NULL) {
+		gnutls_priority_deinit(priority_cache);
+		priority_cache = NULL;
+	}
+	if (resumed_priority_cache != NULL) {
+		gnutls_priority_deinit(resumed_priority_cache);
+		resumed_priority_cache = NULL;
+	}
+	if (creds != NULL) {
+		gnutls_psk_free_server_credentials(creds);
+		creds = NULL;
+	}
+	for (size_t slot = 0; slot < token_slots; slot++) {
+		if (tokens[slot] != NULL) {
+			token_free(tokens[slot]);
+		}
+	}
+	free(tokens);
+	tokens = NULL;
+	token_slots = number_of_tokens = 0;
+	if (ticket_key.data != NULL) {
+		gnutls_memset(ticket_key.data, 0, ticket_key.size);
+		gnutls_free(ticket_key.data);
+		ticket_key.data = NULL;
+	}
+	
 	gnutls_global_deinit();
 	
 	return 0;
@@ -149,7 +827,11 @@ int client_handshake(const size_t fd) {
 	if (clients[fd]->status != HANDSHAKE) {
 		return -1;
 	}
+	struct timespec start, end;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
 	int ret = gnutls_handshake(clients[fd]->session);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	clients[fd]->stats.handshake_ns += (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
 	
 	switch(ret) {
 		case GNUTLS_E_WARNING_ALERT_RECEIVED:
@@ -163,12 +845,30 @@ int client_handshake(const size_t fd) {
 			//fprintf(stderr, "gnutls_handshake() got (%d) %s\n", ret, gnutls_strerror(ret));
 			return 0; //fail, but not fatal
 		case GNUTLS_E_SUCCESS:
-			clients[fd]->status = OPEN;
-			return 0; // success!
+			if (psk_claim(clients[fd]->session) == 0) {
+				clients[fd]->status = OPEN;
+				clients[fd]->stats.resumed = gnutls_session_is_resumed(clients[fd]->session);
+				if (clients[fd]->stats.resumed) {
+					handshakes.resumed++;
+					handshakes.resumed_ns += clients[fd]->stats.handshake_ns;
+				}else{
+					handshakes.full++;
+					handshakes.full_ns += clients[fd]->stats.handshake_ns;
+				}
+				if (profile.ktls && clients[fd]->transport.recv == socket_recv && ktls_enable(clients[fd]) == 0) {
+					clients[fd]->ktls = true;
+				}
+				return 0; // success!
+			}
+			ret = GNUTLS_E_INSUFFICIENT_CREDENTIALS; //the pairing token is gone
+			/* fall through */
 		default:
+			handshakes.failed++;
 			close( fd );
 			gnutls_deinit(clients[fd]->session);
 			clients[fd]->status = CLOSED;
+			open_clients--;
+			session_pool_fill(); //or probes with a bad key leave every later client a gnutls_init()
 			fprintf(stderr, "*** Handshake has failed (%s)\n\n", gnutls_strerror(ret));
 			return -1; //fail, fatal
 	}
@@ -180,7 +880,11 @@ int client_read(const size_t fd, void * const buffer, const size_t size) {
 		return -1;
 	}
 	
-	int ret = gnutls_record_recv(clients[fd]->session, buffer, size);
+	int ret;
+	do {
+		ret = gnutls_record_recv(clients[fd]->session, buffer, size);
+	} while (ret == GNUTLS_E_INTERRUPTED);
+	
 	if (ret == GNUTLS_E_AGAIN){
 		return 0;
 	}else if (ret == 0) {
@@ -189,8 +893,10 @@ int client_read(const size_t fd, void * const buffer, const size_t size) {
 		return -1;
 	} else if (ret < 0 && gnutls_error_is_fatal(ret) == 0) { 
 		fprintf(stderr, "*** Warning: %s\n", gnutls_strerror(ret));
+		return 0;
 	} else if (ret < 0) {
 		fprintf(stderr, "\n*** Received corrupted data(%d). Closing the connection.\n\n", ret);
+		client_close(fd);
 		return -1;
 	} else if (ret > 0) {
 		/* echo data back to the client */
@@ -200,19 +906,182 @@ int client_read(const size_t fd, void * const buffer, const size_t size) {
 	return ret;
 }
 
+/* client_flush() when the kernel makes the records: plaintext straight from the queue */
+static int ktls_flush(const size_t fd) {
+	struct session_tsl * const client = clients[fd];
+	
+	while (client->out_len > 0) {
+		size_t n = client->out_len;
+		if (client->held) {
+			n -= n % KTLS_RECORD;
+			if (n == 0) {
+				break;
+			}
+		}
+		
+		ssize_t ret = send(client->fd, client->out + client->out_head, n, MSG_NOSIGNAL);
+		client->stats.writes++;
+		if (ret == -1 && errno == EINTR) {
+			continue;
+		}else if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break; //socket full, wait for EPOLLOUT
+		}else if (ret == -1) {
+			perror("failed to send data");
+			client_close(fd);
+			return -1;
+		}
+		client->stats.bytes_out += ret;
+		client->out_head += ret;
+		client->out_len -= ret;
+	}
+	
+	if (client->out_len == 0) {
+		client->out_head = 0;
+	}
+	return client->out_len;
+}
+
+int client_flush(const size_t fd) {
+	if (fd >= clients_size || clients[fd] == NULL || clients[fd]->status != OPEN) {
+		return -1;
+	}
+	struct session_tsl * const client = clients[fd];
+	size_t record = gnutls_record_get_max_size(client->session);
+	
+	if (client->ktls) {
+		return ktls_flush(fd);
+	}
+	
+	for (;;) {
+		if (!client->uncorking) {
+			/* held: the tail smaller than a record waits for more data or client_release() */
+			size_t n = client->out_len < FLUSH_CHUNK ? client->out_len : FLUSH_CHUNK;
+			if (client->held) {
+				n -= n % record;
+			}
+			if (n == 0) {
+				break;
+			}
+			
+			/* corked, gnutls only copies: small writes queued one by one leave as full records */
+			gnutls_record_cork(client->session);
+			ssize_t ret = gnutls_record_send(client->session, client->out + client->out_head, n);
+			if (ret < 0) {
+				fprintf(stderr, "failed to send data: (%zd) %s\n", ret, gnutls_strerror(ret));
+				client_close(fd);
+				return -1;
+			}
+			client->out_head += ret;
+			client->out_len -= ret;
+		}
+		
+		int ret = gnutls_record_uncork(client->session, 0);
+		if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED) {
+			client->uncorking = true;
+			break; //socket full, wait for EPOLLOUT
+		}else if (ret < 0) {
+			fprintf(stderr, "failed to send data: (%d) %s\n", ret, gnutls_strerror(ret));
+			client_close(fd);
+			return -1;
+		}
+		client->uncorking = false;
+	}
+	
+	if (client->out_len == 0) {
+		client->out_head = 0;
+	}
+	
+	return client->out_len + gnutls_record_check_corked(client->session);
+}
+
+int client_pending(const size_t fd) {
+	if (fd >= clients_size || clients[fd] == NULL || clients[fd]->status != OPEN) {
+		return -1;
+	}
+	return clients[fd]->out_len + gnutls_record_check_corked(clients[fd]->session);
+}
+
+int client_hold(const size_t fd) {
+	if (fd >= clients_size || clients[fd] == NULL || clients[fd]->status != OPEN) {
+		return -1;
+	}
+	if (!clients[fd]->held) {
+		clients[fd]->held = true;
+		set_tcp_cork(clients[fd], 1);
+	}
+	return 0;
+}
+
+int client_release(const size_t fd) {
+	if (fd >= clients_size || clients[fd] == NULL || clients[fd]->status != OPEN) {
+		return -1;
+	}
+	if (!clients[fd]->held) {
+		return client_flush(fd);
+	}
+	clients[fd]->held = false;
+	int pending = client_flush(fd);
+	if (pending != -1) {
+		set_tcp_cork(clients[fd], 0); //push the last partial segment now
+	}
+	return pending;
+}
+
 int client_write(const size_t fd, const void * const data, const size_t len) {
-	if (clients[fd]->status == OPEN) {
-		return gnutls_record_send(clients[fd]->session, data, len); /* FIXME: blocking */
+	if (fd >= clients_size || clients[fd] == NULL || clients[fd]->status != OPEN) {
+		return -1;
 	}
-	return -1;
+	struct session_tsl * const client = clients[fd];
+	
+	if (client->out_len + len > MAX_OUTBOUND) {
+		fprintf(stderr, "outbound queue full for client %zu\n", fd);
+		return -1;
+	}
+	
+	if (client->out_head + client->out_len + len > client->out_size) {
+		if (client->out_head > 0) {
+			//reclaim the space already sent, gnutls has its own copy of what is in flight
+			memmove(client->out, client->out + client->out_head, client->out_len);
+			client->out_head = 0;
+		}
+		if (client->out_head + client->out_len + len > client->out_size) {
+			size_t size = client->out_size ? client->out_size : 4096;
+			while (size < client->out_head + client->out_len + len) {
+				size *= 2;
+			}
+			uint8_t *tmp = realloc(client->out, size);
+			if (tmp == NULL) {
+				perror("failed to queue data, out of RAM?");
+				return -1;
+			}
+			client->out = tmp;
+			client->out_size = size;
+		}
+	}
+	
+	memcpy(client->out + client->out_head + client->out_len, data, len);
+	client->out_len += len;
+	
+	if (client_flush(fd) == -1) {
+		return -1;
+	}
+	return len;
 }
 
 
 int client_update(const size_t fd, void * const buffer, const size_t size) {
 	
+	if (fd >= clients_size || clients[fd] == NULL) {
+		return -1;
+	}
+	
 	switch (clients[fd]->status) {
 		case HANDSHAKE:
-			return client_handshake(fd);
+			if (client_handshake(fd) || clients[fd]->status != OPEN) {
+				return clients[fd]->status == CLOSED ? -1 : 0;
+			}
+			/* handshake just completed, application data may already be buffered: with an edge triggered fd nobody will call us again for it */
+			/* fall through */
 		case OPEN:
 			return client_read(fd, buffer, size);
 		default:
@@ -222,76 +1091,123 @@ int client_update(const size_t fd, void * const buffer, const size_t size) {
 	
 }
 
-int server_accept(void) {
-	
-	struct sockaddr sa_cli;
-	socklen_t client_len = sizeof(sa_cli);
-	
-	int client_fd = accept4(listen_sd, (struct sockaddr *) &sa_cli, &client_len, SOCK_NONBLOCK); /*SOCK_NONBLOCK*/
+/* set up the TLS server session of a new connection, fd is its index in clients */
+static int client_open(const int client_fd, const struct client_transport * const transport) {
+	if (open_clients >= MAX_CLIENTS) {
+		fprintf(stderr, "too many clients (%d), refusing client %d\n", MAX_CLIENTS, client_fd);
+		close(client_fd);
+		return -2; //refused, but more connection may be pending
+	}
 	
-	if (client_fd < 1) {
-		fprintf(stderr, "failed accept any client %d\n", client_fd);
-		perror("err");
-		return -1;
+	if ((size_t)client_fd >= clients_size) {
+		size_t size = clients_size ? clients_size : 64;
+		while (size <= (size_t)client_fd) {
+			size *= 2;
+		}
+		struct session_tsl ** tmp = realloc(clients, sizeof(struct session_tsl *) * size);
+		if (tmp == NULL) {
+			perror("failed to accept client, out of RAM?");
+			close(client_fd);
+			return -2;
+		}
+		memset(tmp + clients_size, 0, sizeof(struct session_tsl *) * (size - clients_size));
+		clients = tmp;
+		clients_size = size;
 	}
 	
 	if (clients[client_fd] == NULL) {
-		clients[client_fd] = malloc( sizeof(struct session_tsl) );
+		clients[client_fd] = calloc(1, sizeof(struct session_tsl) );
 		if (clients[client_fd] == 0){
 			perror("failed to accept client, out of RAM?");
-			return -1;
+			close(client_fd);
+			return -2;
 		}
 	}
+	struct session_tsl * const client = clients[client_fd];
 	
-	/* open tls server connection */
-	int rc;
-	rc = gnutls_init(&(clients[client_fd]->session), GNUTLS_SERVER | GNUTLS_NONBLOCK);
-	if (rc) {
-		fprintf(stderr, "failed to init session: (%d) %s\n", rc, gnutls_strerror(rc));
-		return -1;
+	if (session_take(&client->session)) {
+		close(client_fd);
+		return -2;
 	}
-	gnutls_psk_set_server_credentials_function(creds, get_psk_creds);
-	rc = gnutls_credentials_set(clients[client_fd]->session, GNUTLS_CRD_PSK, creds);
-	if (rc) {
-		fprintf(stderr, "failed to assign PSK credentials to GnuTLS server: (%d) %s\n", rc, gnutls_strerror(rc));
-		return -1;
+	
+	client->fd = client_fd;
+	if (transport != NULL) {
+		client->transport = *transport;
+	}else{
+		client->transport = (struct client_transport){ .recv = socket_recv, .writev = socket_writev, .opaque = &client->fd };
+		apply_socket_profile(client_fd);
 	}
+	client->in_head = client->in_len = 0;
+	memset(&client->stats, 0, sizeof(client->stats));
+	gnutls_transport_set_ptr(client->session, client);
 	
-	const char priority[] = "NORMAL:-CTYPE-ALL"
-	":%SERVER_PRECEDENCE:%NO_TICKETS"
-	":-VERS-TLS1.0:-VERS-TLS1.1:-VERS-DTLS1.0:-VERS-DTLS1.2"
-	":-CURVE-SECP224R1:-CURVE-SECP192R1"
-	":-SIGN-ALL"
-	":-KX-ALL:+ECDHE-PSK:+DHE-PSK"
-	":-3DES-CBC:-CAMELLIA-128-CBC:-CAMELLIA-256-CBC";
+	client->status = HANDSHAKE;
+	open_clients++;
 	
-	rc = gnutls_priority_init(&(clients[client_fd]->priority_cache), priority, NULL);
-	if (rc) {
-		fprintf(stderr, "failed to set up GnuTLS priority: (%d) %s\n", rc, gnutls_strerror(rc));
-		return -1;
-	}
-	rc = gnutls_priority_set(clients[client_fd]->session, clients[client_fd]->priority_cache);
-	if (rc) {
-		fprintf(stderr, "failed to assign gnutls priority: (%d) %s\n", rc, gnutls_strerror(rc));
-		return -1;
-	}
+	return client_fd;
+}
+
+int server_accept(void) {
 	
-	gnutls_transport_set_int(clients[client_fd]->session, client_fd);
+	struct sockaddr sa_cli;
+	socklen_t client_len = sizeof(sa_cli);
 	
-	clients[client_fd]->status = HANDSHAKE;
+	int client_fd = accept4(listen_sd, (struct sockaddr *) &sa_cli, &client_len, SOCK_NONBLOCK); /*SOCK_NONBLOCK*/
 	
-	return client_fd;
+	if (client_fd < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			fprintf(stderr, "failed accept any client %d\n", client_fd);
+			perror("err");
+		}
+		return -1; //no more pending connection
+	}
+	
+	return client_open(client_fd, NULL);
+}
+
+int server_accept_transport(const struct client_transport * const transport) {
+	/* a descriptor nobody reads, it only reserves a client id no socket can take */
+	int id = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	if (id == -1) {
+		perror("failed to reserve a client id");
+		return -2;
+	}
+	return client_open(id, transport);
+}
+
+int client_stats(const size_t fd, struct client_stats * const stats) {
+	if (fd >= clients_size || clients[fd] == NULL) {
+		return -1;
+	}
+	*stats = clients[fd]->stats;
+	return 0;
 }
 
 int client_close(const size_t fd) {
 	
+	if (fd >= clients_size || clients[fd] == NULL) {
+		return -1;
+	}
+	
 	if (clients[fd]->status != CLOSED) {
-		gnutls_bye(clients[fd]->session, GNUTLS_SHUT_RDWR);
+		if (clients[fd]->ktls) {
+			ktls_close_notify(fd);
+		}else{
+			gnutls_bye(clients[fd]->session, GNUTLS_SHUT_RDWR);
+		}
 		
 		close(fd);
 		gnutls_deinit(clients[fd]->session);
 		
 		clients[fd]->status = CLOSED;
+		open_clients--;
+		
+		free(clients[fd]->out);
+		clients[fd]->out = NULL;
+		clients[fd]->out_head = clients[fd]->out_len = clients[fd]->out_size = 0;
+		clients[fd]->uncorking = clients[fd]->held = clients[fd]->ktls = false;
+		
+		session_pool_fill();
 	}
 	return 0;
 }
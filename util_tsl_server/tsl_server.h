@@ -5,20 +5,122 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* TCP options of the client sockets */
+struct socket_profile{
+	bool nodelay; //TCP_NODELAY, short answers are not delayed waiting for an ACK
+	bool cork; //TCP_CORK between client_hold() and client_release(), only full segments leave
+	int send_buffer; //SO_SNDBUF, 0 keeps the kernel default
+	int receive_buffer; //SO_RCVBUF, 0 keeps the kernel default
+	bool ktls; //after the handshake the kernel encrypts what is sent, when it and the cipher allow it
+};
+
+#define SOCKET_PROFILE_DEFAULT { .nodelay = true, .cork = true, .send_buffer = 0, .receive_buffer = 0, .ktls = false }
+
+/* for the connections accepted from now on */
+void server_set_socket_profile(const struct socket_profile * const profile);
 
 int server_bind(const uint16_t port);
 
+/* 
+ * Opt-in, before server_create(): clients get session tickets valid lifetime
+ * seconds, a device reconnecting with one skips the (EC)DHE exchange (TLS 1.3
+ * clients too, unless they only allow psk_dhe_ke). It never outlives the
+ * pairing token the first handshake used. A stale ticket fails the handshake,
+ * the client connects again without it.
+ */
+void server_set_resumption(const unsigned int lifetime);
+
+/* how the handshake makes the session keys out of the PSK */
+enum kex_profile{
+	KEX_DEFAULT, //ECDHE-PSK or DHE-PSK with large finite field groups, whatever the client prefers
+	KEX_X25519, //ECDHE-PSK on X25519 only, the cheapest with forward secrecy
+	KEX_PSK, //the PSK alone, no forward secrecy: for isolated links only
+};
+
+/* before server_create(), KEX_DEFAULT otherwise */
+void server_set_kex_profile(const enum kex_profile profile);
+
+/* pskhex gets the PSK of the "openpgp-skt" identity, the one of the usual QR code */
 int server_create(char * const pskhex, size_t pskhexsz);
 
+/* longest identity a pairing token can have */
+#define PSK_IDENTITY_MAX 64
+
+/* 
+ * Pairing tokens: more PSKs, each with the identity a client must send to
+ * use it, ie. one QR code per device. A token expires after lifetime
+ * seconds (0 for never) and a one-shot token lets a single handshake in.
+ * pskhex gets the new PSK like for server_create().
+ */
+int server_add_psk(const char * const identity, char * const pskhex, size_t pskhexsz, const unsigned int lifetime, const bool one_shot);
+/* -1 if there is no such token, handshakes under way with it fail */
+int server_remove_psk(const char * const identity);
+size_t server_psk_count(void);
+
+/* return the new client fd, -1 if there is no pending connection, -2 if a connection has been refused */
 int server_accept(void);
 
+/* byte stream carrying the TLS records, a socket unless given to server_accept_transport() */
+struct client_transport{
+	/* like recv() and writev(): -1 with errno EAGAIN when it would block */
+	ssize_t (*recv)(void * const opaque, void * const buffer, const size_t size);
+	ssize_t (*writev)(void * const opaque, const struct iovec * const iov, const int iovcnt);
+	void *opaque;
+};
+
+/* a client over any transport, ie. in memory for tests and benchmarks; return its id like server_accept() */
+int server_accept_transport(const struct client_transport * const transport);
+
+/* what went through the transport of a client, TLS overhead included (not the one the kernel adds with kTLS) */
+struct client_stats{
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t reads; //recv() calls
+	uint64_t writes; //writev() calls
+	bool resumed; //the handshake used a session ticket
+	uint64_t handshake_ns; //CPU time gnutls_handshake() took
+};
+
+/* still available after client_close(), until the id is reused */
+int client_stats(const size_t fd, struct client_stats * const stats);
+
+/* completed handshakes since server_create() */
+struct handshake_stats{
+	uint64_t full;
+	uint64_t resumed;
+	uint64_t failed;
+	uint64_t full_ns; //CPU time of the full handshakes, all of them
+	uint64_t resumed_ns;
+};
+
+void server_handshake_stats(struct handshake_stats * const stats);
+
 int server_close(void);
 
 int client_close(const size_t fd) ;
 
 int client_update(const size_t fd, void * const buffer, const size_t size);
 
+/* queue data for the client and send as much as the socket accept, return len or -1 */
 int client_write(const size_t fd, const void * const data, const size_t len);
 
+/* send queued data, call it when the socket is writable; return bytes still queued or -1 */
+int client_flush(const size_t fd);
+
+/* bytes queued and not yet sent, or -1 */
+int client_pending(const size_t fd);
+
+/* 
+ * Around a bulk transfer: while held, the writes only leave in full TLS
+ * records (and full TCP segments with the cork profile); release sends the
+ * rest and returns like client_flush().
+ */
+int client_hold(const size_t fd);
+int client_release(const size_t fd);
+
 
 #endif